@@ -0,0 +1,77 @@
+/*
+ * aliasing.cpp
+ *
+ * The fields of polymorphic classes unrelated by inheritance may still
+ * overlap: a Wheel is a member of a Car, and a Flag is created with
+ * placement new in storage a Counter used before. The vtable pointer
+ * alias analysis must not let loads be reused across either write.
+ * Exits with 0 if every read sees the last write.
+ */
+
+// OPT: -mem2reg -vtable-pointer-aa -gvn
+// CHECK-LABEL: define {{.*}}@_ZL6resizeP3CarP5Wheel(
+// CHECK: = load i32*
+// CHECK: store i32 18
+// CHECK: = load i32*
+// CHECK-LABEL: define {{.*}}@_ZL5reuseP7CounterPv(
+// CHECK: call {{.*}}@_ZN7CounterC1Ev
+// CHECK: = load i32*
+
+#include <new>
+
+class Wheel {
+public:
+	Wheel() : size(16) {}
+	virtual ~Wheel() {}
+	virtual int kind(void) {return 1;}
+	int size;
+};
+
+class Car {
+public:
+	virtual ~Car() {}
+	virtual int kind(void) {return 2;}
+	Wheel wheel;
+};
+
+class Counter {
+public:
+	Counter() : count(0) {}
+	virtual ~Counter() {}
+	virtual int kind(void) {return 3;}
+	int count;
+};
+
+class Flag {
+public:
+	Flag() : set(1) {}
+	virtual ~Flag() {}
+	virtual int kind(void) {return 4;}
+	int set;
+};
+
+static int resize(Car* car, Wheel* wheel) {
+	const int before = car->wheel.size;
+	wheel->size = 18;
+	return before + car->wheel.size;
+}
+
+static int reuse(Counter* counter, void* storage) {
+	counter->count = 7;
+	counter->~Counter();
+	Flag* const flag = new (storage) Flag();
+	flag->set = 9;
+	const int set = flag->set;
+	flag->~Flag();
+	Counter* const again = new (storage) Counter();
+	return set * 10 + again->count;
+}
+
+int main(int argc, char** args) {
+	Car car;
+	const int sizes = resize(&car, &car.wheel);
+	Counter* const counter = new Counter();
+	const int set = reuse(counter, counter);
+	delete counter;
+	return sizes == 34 && set == 90 ? 0 : 1;
+}
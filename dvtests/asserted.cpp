@@ -0,0 +1,50 @@
+/*
+ * asserted.cpp
+ *
+ * The programmer asserts that the object s points to is exactly a Circle.
+ * The call to area() says so, and from then on the later calls on the same
+ * object can use that class too: the calls to perimeter() in the loop go
+ * straight to Circle's method, not just the annotated call. Exits with 0
+ * if every call and the typeid query see a Circle.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZL7measureP5Shapei(
+// CHECK: call {{.*}}@_ZN6Circle4areaEv
+// CHECK: call {{.*}}@_ZN6Circle9perimeterEv
+
+#include <typeinfo>
+
+#ifdef __clang__
+#define EXACT_TYPE __attribute__((annotate("exact_type")))
+#else
+#define EXACT_TYPE
+#endif
+
+class Shape {
+public:
+	virtual ~Shape() {}
+	virtual int area(void) {return 0;}
+	virtual int perimeter(void) {return 0;}
+};
+
+class Circle : public Shape {
+public:
+	virtual int area(void) {return 3;}
+	virtual int perimeter(void) {return 6;}
+};
+
+static int measure(Shape* shape, int n) {
+	Shape* s EXACT_TYPE = shape;
+	int total = s->area();
+	for (int i = 0; i < n; ++i)
+		total += shape->perimeter();
+	if (typeid(*shape) != typeid(Circle))
+		return -1;
+	return total;
+}
+
+int main(int argc, char** args) {
+	Circle circle;
+	return measure(&circle, 4) == 27 ? 0 : 1;
+}
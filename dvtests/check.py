@@ -0,0 +1,137 @@
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+# Checks the tests given as arguments: compiles each with the frontend, runs
+# opt with the devirtualization pass loaded and the arguments of its OPT:
+# lines, and matches the optimized IR against its CHECK lines, as FileCheck
+# does ({{...}} is a regular expression). CHECK: lines match in order,
+# CHECK-DAG: lines in any order, and CHECK-NOT: lines must not match between
+# the lines around them. A CHECK-LABEL: line starts the checks of the
+# function defined on the line it matches, wherever it is in the module, so
+# that they do not depend on the order functions are emitted in. STRIP:
+# lines name instruction metadata to remove before opt runs, as if another
+# frontend had built the test. The optimized program must exit 0.
+# CLANG, OPT, LLI and DEVIRT (the pass's loadable module) may be overridden
+# from the environment.
+
+CLANG = os.environ.get('CLANG', 'clang')
+OPT = os.environ.get('OPT', 'opt')
+LLI = os.environ.get('LLI', 'lli')
+DEVIRT = os.environ.get('DEVIRT', '../Release/lib/Devirtualization.so')
+
+def pattern(check):
+  regex = ''
+  for (i, part) in enumerate(re.split(r'\{\{(.*?)\}\}', check)):
+    regex += '(?:' + part + ')' if i % 2 else re.escape(part)
+  return re.compile(regex)
+
+def directives(source):
+  flags = []
+  stripped = []
+  checks = []
+  for line in open(source):
+    match = re.search(r'//\s*(OPT|STRIP|CHECK|CHECK-[A-Z]+):(.*)$', line)
+    if not match:
+      continue
+    if match.group(1) == 'OPT':
+      flags += match.group(2).split()
+    elif match.group(1) == 'STRIP':
+      stripped += match.group(2).split()
+    else:
+      checks.append((match.group(1), match.group(2).strip()))
+  return (flags, stripped, checks)
+
+def find(lines, check, start):
+  return next((i for i in range(start, len(lines))
+               if pattern(check).search(lines[i])), None)
+
+def absent(lines, excluded, start, end):
+  for no in excluded:
+    if any(pattern(no).search(line) for line in lines[start:end]):
+      return 'CHECK-NOT: ' + no + ' found'
+  return None
+
+def match_block(lines, checks):
+  start = 0
+  excluded = []
+  dag = []
+  for (kind, check) in checks + [('END', None)]:
+    if kind == 'CHECK-DAG':
+      dag.append(check)
+      continue
+    if dag:
+      found = [find(lines, check, start) for check in dag]
+      if None in found:
+        return 'CHECK-DAG: ' + dag[found.index(None)] + ' not found'
+      error = absent(lines, excluded, start, min(found))
+      if error:
+        return error
+      (start, excluded, dag) = (max(found) + 1, [], [])
+    if kind == 'CHECK-NOT':
+      excluded.append(check)
+    elif kind == 'CHECK':
+      found = find(lines, check, start)
+      if found is None:
+        return 'CHECK: ' + check + ' not found'
+      error = absent(lines, excluded, start, found)
+      if error:
+        return error
+      (start, excluded) = (found + 1, [])
+    else:
+      return absent(lines, excluded, start, len(lines))
+  return None
+
+def match(lines, checks):
+  blocks = [(None, [])]
+  for (kind, check) in checks:
+    if kind == 'CHECK-LABEL':
+      blocks.append((check, []))
+    else:
+      blocks[-1][1].append((kind, check))
+  for (label, block) in blocks:
+    body = lines
+    if label is not None:
+      begin = find(lines, label, 0)
+      if begin is None:
+        return 'CHECK-LABEL: ' + label + ' not found'
+      end = find(lines, '{{^}}}', begin)
+      body = lines[begin + 1:end]
+    error = match_block(body, block)
+    if error:
+      return error
+  return None
+
+def check(source, tmp):
+  (flags, stripped, checks) = directives(source)
+  name = os.path.splitext(os.path.basename(source))[0]
+  ll = os.path.join(tmp, name + '.ll')
+  opt_ll = os.path.join(tmp, name + '_opt.ll')
+  subprocess.check_call([CLANG, '-g', '-emit-llvm', '-S', source, '-o', ll])
+  if stripped:
+    ir = open(ll).read()
+    for kind in stripped:
+      ir = re.sub(r', !' + re.escape(kind) + r' !\d+', '', ir)
+    open(ll, 'w').write(ir)
+  subprocess.check_call([OPT, '-load', DEVIRT, '-S'] + flags
+                        + [ll, '-o', opt_ll])
+  error = match(open(opt_ll).read().splitlines(), checks)
+  if not error and subprocess.call([LLI, opt_ll]):
+    error = 'optimized program failed'
+  return error
+
+failed = 0
+tmp = tempfile.mkdtemp()
+for source in sys.argv[1:]:
+  try:
+    error = check(source, tmp)
+  except subprocess.CalledProcessError as e:
+    error = str(e)
+  if error:
+    print('FAIL ' + source + ': ' + error)
+    failed += 1
+  else:
+    print('PASS ' + source)
+sys.exit(1 if failed else 0)
@@ -0,0 +1,59 @@
+/*
+ * choose.cpp
+ *
+ * The "choose an implementation, then call it" shape: the receiver is a
+ * select or a phi of new objects whose classes are exact. The call is
+ * split into one copy per incoming object, each devirtualized to that
+ * object's class. Exits with 0 if every call reaches the right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZL9viaSelectbi(
+// CHECK-DAG: call {{.*}}@_ZN8Doubling6encodeEi
+// CHECK-DAG: call {{.*}}@_ZN8Negating6encodeEi
+// CHECK-LABEL: define {{.*}}@_ZL6viaPhiii(
+// CHECK-DAG: call {{.*}}@_ZN8Doubling6encodeEi
+// CHECK-DAG: call {{.*}}@_ZN8Negating6encodeEi
+// CHECK-DAG: call {{.*}}@_ZN5Codec6encodeEi
+
+class Codec {
+public:
+	virtual ~Codec() {}
+	virtual int encode(int value) {return value;}
+};
+
+class Doubling : public Codec {
+public:
+	virtual int encode(int value) {return value * 2;}
+};
+
+class Negating : public Codec {
+public:
+	virtual int encode(int value) {return -value;}
+};
+
+static int viaSelect(bool doubling, int value) {
+	Codec* const codec = doubling ? (Codec*)new Doubling : (Codec*)new Negating;
+	const int result = codec->encode(value);
+	delete codec;
+	return result;
+}
+
+static int viaPhi(int kind, int value) {
+	Codec* codec;
+	if (kind == 0)
+		codec = new Doubling;
+	else if (kind == 1)
+		codec = new Negating;
+	else
+		codec = new Codec;
+	const int result = codec->encode(value);
+	delete codec;
+	return result;
+}
+
+int main(int argc, char** args) {
+	return viaSelect(true, 3) == 6 && viaSelect(false, 3) == -3
+	       && viaPhi(0, 5) == 10 && viaPhi(1, 5) == -5 && viaPhi(2, 5) == 5
+	       ? 0 : 1;
+}
@@ -0,0 +1,54 @@
+/*
+ * covariant.cpp
+ *
+ * Shape::clone is overridden with a covariant return type by Square, whose
+ * Shape base is not at offset 0. The override must be found (clone is not
+ * devirtualized to Shape::clone), and a call devirtualized to Square::clone
+ * must convert the returned Square* to the Shape* the caller expects.
+ * Exits with 0 if both hold.
+ */
+
+// OPT: -mem2reg -devirt -devirt-whole-program
+// CHECK-LABEL: define {{.*}}@_ZL5checkPK5Shapei(
+// CHECK-NOT: @_ZNK5Shape5cloneEv
+// CHECK-LABEL: define i32 @main(
+// CHECK-NOT: @_ZNK5Shape5cloneEv
+// CHECK: call {{.*}}@_ZNK6Square5cloneEv
+// CHECK-NOT: @_ZNK5Shape5cloneEv
+
+class Shape {
+public:
+	virtual ~Shape() {}
+	virtual Shape* clone(void) const {return new Shape();}
+	virtual int sides(void) const {return 0;}
+};
+
+class Named {
+public:
+	virtual ~Named() {}
+	long id;
+};
+
+class Square : public Named, public Shape {
+public:
+	virtual Square* clone(void) const {return new Square();}
+	virtual int sides(void) const {return 4;}
+};
+
+static int check(const Shape* s, const int sides) {
+	Shape* copy = s->clone();
+	const int result = copy->sides() == sides ? 0 : 1;
+	delete copy;
+	return result;
+}
+
+int main(int argc, char** args) {
+	Square* square = new Square();
+	const Shape* shape = square;
+	int result = check(shape, 4);
+	Shape* copy = shape->clone();
+	result |= dynamic_cast<Square*>(copy) == 0;
+	delete copy;
+	delete square;
+	return result;
+}
@@ -0,0 +1,47 @@
+/*
+ * destructor.cpp
+ *
+ * Deleting through a base pointer calls the deleting destructor (D0) from
+ * the vtable. The Node deleted here is known to be a new Leaf, so the pass
+ * resolves the virtual delete to Leaf's deleting destructor, once the
+ * virtual in-class declarations are linked to the destructors' variant
+ * definitions. Exits with 0 if every destructor ran once.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZL7releasei(
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN4tree4Leaf6weightEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN4tree4LeafD0Ev
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+namespace tree {
+int destroyed = 0;
+
+class Node {
+public:
+	virtual ~Node() {destroyed += 1;}
+	virtual int weight(void) {return 1;}
+};
+
+class Leaf : public Node {
+public:
+	virtual ~Leaf() {destroyed += 10;}
+	virtual int weight(void) {return 2;}
+};
+}
+
+static int release(int n) {
+	int total = 0;
+	for (int i = 0; i < n; ++i) {
+		tree::Node* const node = new tree::Leaf();
+		total += node->weight();
+		delete node;
+	}
+	return total;
+}
+
+int main(int argc, char** args) {
+	return release(3) == 6 && tree::destroyed == 33 ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+/*
+ * diamond.cpp
+ *
+ * Multiple and virtual inheritance. Reader and Writer share the virtual
+ * base Stream; File inherits both, and the final overrider of each method
+ * depends on the subobject it is called through: Writer::name is the one
+ * for Writer's subobject, even though Reader, to the left, does not
+ * override it. Calls on the complete local object are resolved per
+ * subobject, with the this adjustment the secondary vtables would make.
+ * Exits with 0 if every call reaches the right method with the right this.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define i32 @main(
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN6Writer4nameEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN4File5flagsEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN6Writer4nameEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN4File5flagsEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN6Stream4nameEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN6Reader5flagsEv
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+class Stream {
+public:
+	Stream() : handle(1) {}
+	virtual ~Stream() {}
+	virtual int name(void) {return handle;}
+	virtual int flags(void) {return 0;}
+	int handle;
+};
+
+class Reader : public virtual Stream {
+public:
+	Reader() : readable(10) {}
+	virtual int flags(void) {return readable;}
+	int readable;
+};
+
+class Writer : public virtual Stream {
+public:
+	Writer() : writable(100) {}
+	virtual int name(void) {return writable + handle;}
+	int writable;
+};
+
+class File : public Reader, public Writer {
+public:
+	File() : open(1000) {}
+	virtual int flags(void) {return open + readable;}
+	int open;
+};
+
+class Pipe : public Reader {
+public:
+	Pipe() : buffered(2000) {}
+	int buffered;
+};
+
+int main(int argc, char** args) {
+	File file;
+	Writer* const writer = &file;
+	Reader* const reader = &file;
+	Stream* const stream = &file;
+	Pipe pipe;
+	Stream* const pipeStream = &pipe;
+	return writer->name() == 101 && reader->flags() == 1010
+	       && stream->name() == 101 && stream->flags() == 1010
+	       && pipeStream->name() == 1 && pipeStream->flags() == 10 ? 0 : 1;
+}
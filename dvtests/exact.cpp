@@ -0,0 +1,52 @@
+/*
+ * exact.cpp
+ *
+ * Receivers whose dynamic type is their static type: elements of an array
+ * of objects, a member object held by value, and a reference bound
+ * directly to a local object. The frontend calls the methods directly,
+ * without going through the vtable. Exits with 0 if every call reaches the
+ * right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define i32 @main(
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN7Doubler6handleEi
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN7Handler6handleEi
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK-LABEL: define {{.*}}@_ZN9Composite3runEi(
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN7Doubler6handleEi
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN7Doubler6handleEi
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+class Handler {
+public:
+	virtual ~Handler() {}
+	virtual int handle(int value) {return value + 1;}
+};
+
+class Doubler : public Handler {
+public:
+	virtual int handle(int value) {return value * 2;}
+};
+
+class Composite {
+public:
+	int run(int value) {return inner.handle(value) + this->inner.handle(1);}
+	Doubler inner;
+};
+
+int main(int argc, char** args) {
+	Doubler table[3];
+	int total = 0;
+	for (int i = 0; i < 3; ++i)
+		total += table[i].handle(i);
+	Composite composite;
+	Handler local;
+	Handler& alias = local;
+	return total == 6 && composite.run(5) == 12 && alias.handle(4) == 5
+	       ? 0 : 1;
+}
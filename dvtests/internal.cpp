@@ -0,0 +1,56 @@
+/*
+ * internal.cpp
+ *
+ * The shapes live in an anonymous namespace, so every class deriving from
+ * them is in this file. The inline helpers are deferred, which lets the
+ * calls through Shape* be devirtualized where no class of the hierarchy
+ * overrides the method (Shape::sides), and kept virtual where one does,
+ * including inside a nested class and a template specialization. Exits
+ * with 0 if every call reaches the right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_Z5sidesPN12_GLOBAL__N_15ShapeE(
+// CHECK: call {{.*}}@_ZN12_GLOBAL__N_15Shape5sidesEv
+// CHECK-LABEL: define {{.*}}@_Z4areaPN12_GLOBAL__N_15ShapeE(
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+namespace {
+class Shape {
+public:
+	virtual ~Shape() {}
+	virtual int sides(void) {return 0;}
+	virtual int area(void) {return 0;}
+};
+
+class Square : public Shape {
+public:
+	virtual int area(void) {return 4;}
+};
+
+struct Outer {
+	class Triangle : public Shape {
+	public:
+		virtual int area(void) {return 3;}
+	};
+};
+
+template <int N> class Polygon : public Shape {
+public:
+	virtual int area(void) {return N;}
+};
+}
+
+inline int sides(Shape* s) {return s->sides();}
+inline int area(Shape* s) {return s->area();}
+
+int main(int argc, char** args) {
+	Square square;
+	Outer::Triangle triangle;
+	Polygon<5> pentagon;
+	Shape* shapes[3] = {&square, &triangle, &pentagon};
+	int total = 0;
+	for (int i = 0; i < 3; ++i)
+		total += sides(shapes[i]) * 100 + area(shapes[i]);
+	return total == 12 ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * memberslot.cpp
+ *
+ * Pair's vtable holds its primary vtable (shared with First) followed by the
+ * secondary one of Second. Triple adds a method, whose member pointer is
+ * cast to a pointer to a member of Pair: its slot lies past the end of
+ * Pair's primary vtable. Resolving it in Pair's vtable must not read into
+ * the secondary vtable, which would call a method of Second instead of
+ * Triple::extra, so that call stays indirect while the one to Pair::value
+ * is resolved. Exits with 0 if each member pointer call reaches the right
+ * method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define i32 @main(
+// CHECK: call {{.*}}@_ZN4Pair5valueEv
+// CHECK-NOT: @_ZN6Second5otherEv
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK-NOT: @_ZN6Second5otherEv
+
+class First {
+public:
+	virtual ~First() {}
+	virtual int value(void) {return 1;}
+};
+
+class Second {
+public:
+	virtual ~Second() {}
+	virtual int other(void) {return 2;}
+};
+
+class Pair : public First, public Second {
+public:
+	virtual int value(void) {return 3;}
+};
+
+class Triple : public Pair {
+public:
+	virtual int extra(void) {return 4;}
+};
+
+int main(int argc, char** args) {
+	Triple triple;
+	Pair* const pair = &triple;
+	int (Pair::*const value)(void) = &Pair::value;
+	int (Pair::*const extra)(void) =
+		static_cast<int (Pair::*)(void)>(&Triple::extra);
+	return (pair->*value)() == 3 && (pair->*extra)() == 4 ? 0 : 1;
+}
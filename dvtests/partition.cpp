@@ -0,0 +1,64 @@
+/*
+ * partition.cpp
+ *
+ * A sum over an array of polymorphic pointers is partitioned by class: the
+ * element indices are sorted into one bucket per class, in a stack buffer
+ * for the short array and a heap one for the long array, then each bucket
+ * is summed with direct calls. Exits with 0 if both sums are right.
+ */
+
+// OPT: -mem2reg -loop-rotate -simplifycfg -indvars -loopsimplify -lcssa -devirt -devirt-whole-program
+// CHECK-LABEL: define {{.*}}@_ZL9countLegsPP6Animalj(
+// CHECK-DAG: partition.stack = alloca
+// CHECK-DAG: call {{.*}}@malloc
+// CHECK-DAG: call {{.*}}@_ZNK4Bird4legsEv
+// CHECK-DAG: call {{.*}}@_ZNK3Dog4legsEv
+// CHECK-DAG: call {{.*}}@free
+
+class Animal {
+public:
+	virtual ~Animal() {}
+	virtual int legs(void) const = 0;
+};
+
+class Bird : public Animal {
+public:
+	virtual int legs(void) const {return 2;}
+};
+
+class Dog : public Animal {
+public:
+	virtual int legs(void) const {return 4;}
+};
+
+static int countLegs(Animal** animals, unsigned n) {
+	int sum = 0;
+	for (unsigned i = 0; i < n; ++i) {
+		sum += animals[i]->legs();
+	}
+	return sum;
+}
+
+static int check(unsigned n) {
+	Animal** animals = new Animal*[n];
+	int expected = 0;
+	for (unsigned i = 0; i < n; ++i) {
+		if (i % 3) {
+			animals[i] = new Bird();
+			expected += 2;
+		} else {
+			animals[i] = new Dog();
+			expected += 4;
+		}
+	}
+	const int sum = countLegs(animals, n);
+	for (unsigned i = 0; i < n; ++i) {
+		delete animals[i];
+	}
+	delete[] animals;
+	return sum == expected ? 0 : 1;
+}
+
+int main(int argc, char** args) {
+	return check(100) | check(100000);
+}
@@ -0,0 +1,52 @@
+/*
+ * primarychain.cpp
+ *
+ * The class of the new object is known, so calls through p go straight to
+ * the final overrider. Base is not the primary base of Mixed, so p points
+ * into the middle of the object: Mixed::f must still be called with the
+ * adjusted this (through the vtable's thunk), not with p. Base is the
+ * primary base of Primary, so that call can go straight to Primary::f.
+ * Exits with 0 if each method sees the fields of its own object.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define i32 @main(
+// CHECK-NOT: @_ZN4Base1fEv
+// CHECK: call {{.*}}@_ZN7Primary1fEv
+// CHECK-NOT: @_ZN4Base1fEv
+
+struct Extra {
+	Extra() : extra(7) {}
+	virtual ~Extra() {}
+	virtual int g(void) {return extra;}
+	int extra;
+};
+
+struct Base {
+	Base() : base(1) {}
+	virtual ~Base() {}
+	virtual int f(void) {return base;}
+	int base;
+};
+
+struct Mixed : Extra, Base {
+	Mixed() : mixed(10) {}
+	virtual int f(void) {return mixed + base;}
+	int mixed;
+};
+
+struct Primary : Base, Extra {
+	Primary() : primary(100) {}
+	virtual int f(void) {return primary + base;}
+	int primary;
+};
+
+int main(int argc, char** args) {
+	Base* p = new Mixed;
+	const int mixed = p->f();
+	delete p;
+	Base* q = new Primary;
+	const int primary = q->f();
+	delete q;
+	return mixed == 11 && primary == 101 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+/*
+ * readonly.cpp
+ *
+ * Every overrider of Account::balance the module defines only reads
+ * memory, but Account is exported and a plugin could override it with one
+ * that writes. Without -devirt-whole-program, the still-virtual call in
+ * the loop must therefore not be marked readonly, nor hoisted. Exits with
+ * 0 if the sum sees every deposit.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZL3sumP7Accounti(
+// CHECK-NOT: readonly
+// CHECK-NOT: readnone
+
+class Account {
+public:
+	Account() : total(0) {}
+	virtual ~Account() {}
+	virtual int balance(void) const {return total;}
+	virtual void deposit(int amount) {total += amount;}
+	int total;
+};
+
+class Savings : public Account {
+public:
+	virtual int balance(void) const {return total * 2;}
+};
+
+static int sum(Account* a, int n) {
+	int s = 0;
+	for (int i = 0; i < n; ++i) {
+		a->deposit(1);
+		s += a->balance();
+	}
+	return s;
+}
+
+int main(int argc, char** args) {
+	Account* a = argc > 1 ? (Account*)new Savings() : new Account();
+	const int expected = argc > 1 ? 110 : 55;
+	const int result = sum(a, 10);
+	delete a;
+	return result == expected ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+/*
+ * receivers.cpp
+ *
+ * Virtual calls on each kind of receiver the frontend records: this, a
+ * parameter, a field, a local and a new-expression. The metadata also
+ * names the receiver's static class, so only overriders in subclasses of
+ * it are considered. Middle and Leaf inherit Root::value, which only Other
+ * overrides, so with the hierarchy closed (-devirt-whole-program) the calls
+ * through a Middle* go straight to Root::value, while the call on this in
+ * Root::twice stays virtual. Exits with 0 if every call reaches the right
+ * method.
+ */
+
+// OPT: -mem2reg -devirt -devirt-whole-program
+// CHECK-LABEL: define {{.*}}@_ZN4Root5twiceEv(
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK-LABEL: define {{.*}}@_ZL9parameterP6Middle(
+// CHECK: call {{.*}}@_ZN4Root5valueEv
+// CHECK-LABEL: define {{.*}}@_ZN6Holder5valueEv(
+// CHECK: call {{.*}}@_ZN4Root5valueEv
+// CHECK-LABEL: define i32 @main(
+// CHECK: call {{.*}}@_ZN4Root5valueEv
+// CHECK: call {{.*}}@_ZN4Root5valueEv
+
+class Root {
+public:
+	virtual ~Root() {}
+	virtual int value(void) {return 1;}
+	int twice(void) {return value() * 2;}
+};
+
+class Middle : public Root {
+public:
+	virtual int depth(void) {return 2;}
+};
+
+class Leaf : public Middle {
+public:
+	virtual int depth(void) {return 3;}
+};
+
+class Other : public Root {
+public:
+	virtual int value(void) {return 4;}
+};
+
+class Holder {
+public:
+	Holder(Middle* m) : middle(m) {}
+	int value(void) {return middle->value();}
+	Middle* middle;
+};
+
+static int parameter(Middle* m) {return m->value();}
+
+int main(int argc, char** args) {
+	Leaf leaf;
+	Other other;
+	Holder holder(&leaf);
+	Middle* local = &leaf;
+	Middle* created = new Leaf;
+	const int fromNew = created->value() + created->depth();
+	delete created;
+	return leaf.twice() == 2 && other.twice() == 8 && parameter(&leaf) == 1
+	       && holder.value() == 1 && local->value() == 1 && fromNew == 4
+	       && leaf.depth() == 3 ? 0 : 1;
+}
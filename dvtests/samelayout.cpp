@@ -0,0 +1,45 @@
+/*
+ * samelayout.cpp
+ *
+ * Printer and Counter are unrelated but laid out identically (a vtable
+ * pointer only), so their IR types are the same. Built without the
+ * virtual-call metadata, the calls are recognized by their IR pattern, and
+ * their receiver type must not be taken to name either class. Exits with 0
+ * if each call reached its own class's method.
+ */
+
+// OPT: -mem2reg -devirt -devirt-whole-program
+// STRIP: virtual-call
+// CHECK-LABEL: define {{.*}}@_ZL6runAllP7PrinterP7Counter(
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+class Printer {
+public:
+	virtual ~Printer() {}
+	virtual int run(void) {return 1;}
+};
+
+class Counter {
+public:
+	virtual ~Counter() {}
+	virtual int step(void) {return 2;}
+};
+
+class FastCounter : public Counter {
+public:
+	virtual int step(void) {return 3;}
+};
+
+static int runAll(Printer* p, Counter* c) {
+	return p->run() * 10 + c->step();
+}
+
+int main(int argc, char** args) {
+	Printer* p = new Printer();
+	Counter* c = new FastCounter();
+	const int result = runAll(p, c);
+	delete p;
+	delete c;
+	return result == 13 ? 0 : 1;
+}
@@ -0,0 +1,42 @@
+/*
+ * sealed.cpp
+ *
+ * Plugin is exported, but its hierarchy is sealed: the current link unit
+ * defines every class deriving from it. The pass then treats the hierarchy
+ * as closed without -devirt-whole-program. No class overrides version(),
+ * so the call through Plugin* goes straight to Plugin::version, while the
+ * call to channels(), which Audio overrides, stays virtual. Exits with 0 if
+ * every call reaches the right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define i32 @_Z8describeP6Plugin(
+// CHECK: call {{.*}}@_ZN6Plugin7versionEv
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+#ifdef __clang__
+#define SEALED __attribute__((annotate("sealed")))
+#else
+#define SEALED
+#endif
+
+class SEALED Plugin {
+public:
+	virtual ~Plugin() {}
+	virtual int version(void) {return 1;}
+	virtual int channels(void) {return 0;}
+};
+
+class Audio : public Plugin {
+public:
+	virtual int channels(void) {return 2;}
+};
+
+int describe(Plugin* plugin) {
+	return plugin->version() * 10 + plugin->channels();
+}
+
+int main(int argc, char** args) {
+	Audio audio;
+	return describe(&audio) == 12 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+/*
+ * structor.cpp
+ *
+ * While a constructor or destructor runs, its object is of the class being
+ * constructed or destroyed, but only after it has stored its vtable: the
+ * call to who() in Base's constructor must reach Base::who, and in
+ * Derived's constructor only the call after Derived stores its own vtable
+ * (the base constructor call before it could construct the object again)
+ * may be resolved to Derived::who. Exits with 0 if every call reaches the
+ * right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZN4BaseC2Ev(
+// CHECK: call {{.*}}@_ZN4Base3whoEv
+// CHECK-LABEL: define {{.*}}@_ZN7DerivedC2Ev(
+// CHECK: call {{.*}}@_ZN4BaseC2Ev
+// CHECK: store {{.*}}@_ZTV7Derived
+// CHECK: call {{.*}}@_ZN7Derived3whoEv
+// CHECK-LABEL: define {{.*}}@_ZN7DerivedD2Ev(
+// CHECK: call {{.*}}@_ZN7Derived3whoEv
+// CHECK: call {{.*}}@_ZN4BaseD2Ev
+
+static int trace = 0;
+
+class Base {
+public:
+	Base() {trace = trace * 10 + who();}
+	virtual ~Base() {trace = trace * 10 + who();}
+	virtual int who(void) {return 1;}
+};
+
+class Derived : public Base {
+public:
+	Derived() {trace = trace * 10 + who();}
+	virtual ~Derived() {trace = trace * 10 + who();}
+	virtual int who(void) {return 2;}
+};
+
+int main(int argc, char** args) {
+	{
+		Derived object;
+	}
+	return trace == 1221 ? 0 : 1;
+}
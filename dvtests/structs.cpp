@@ -0,0 +1,43 @@
+/*
+ * structs.cpp
+ *
+ * An interface hierarchy declared with struct rather than class: Logger
+ * implements the pure method of Sink and also derives from the plain
+ * struct Handler. The call through a Sink* to a new Logger goes straight to
+ * Logger::write, which takes both structs being part of the hierarchy.
+ * Exits with 0 if every call reaches the right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZL3logi(
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+// CHECK: call {{.*}}@_ZN6Logger5writeEi
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+struct Sink {
+	virtual int write(int value) = 0;
+};
+
+struct Handler {
+	int handled;
+};
+
+struct Logger : Handler, Sink {
+	Logger() {handled = 0;}
+	virtual int write(int value) {handled += value; return handled;}
+};
+
+static int log(int n) {
+	Logger* const logger = new Logger;
+	Sink* const sink = logger;
+	int last = 0;
+	for (int i = 1; i <= n; ++i)
+		last = sink->write(i);
+	const int handled = logger->handled;
+	delete logger;
+	return handled == last ? last : -1;
+}
+
+int main(int argc, char** args) {
+	return log(4) == 10 ? 0 : 1;
+}
@@ -1,3 +1,4 @@
 #/bin/bash
+python3 check.py `grep -l "// CHECK" *.cpp` || exit 1
 ls *.out | ./time.sh 5 3>&1 1>&2 2>&3 | python3 average.py
 ls *.out.opt | ./time.sh 5 3>&1 1>&2 2>&3 | python3 average.py
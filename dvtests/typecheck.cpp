@@ -0,0 +1,49 @@
+/*
+ * typecheck.cpp
+ *
+ * Each virtual call is dominated by a check of its receiver's dynamic
+ * type, a dynamic_cast or a typeid comparison, so the receiver's class is
+ * exact where the call runs. The calls are rewritten to Square's and
+ * Circle's methods even though the receivers are only known as Shapes.
+ * Exits with 0 if every call reaches the right method.
+ */
+
+// OPT: -mem2reg -devirt -devirt-whole-program
+// CHECK-LABEL: define {{.*}}@_ZL4areaP5Shape(
+// CHECK: call {{.*}}@_ZN6Square4areaEv
+// CHECK: call {{.*}}@_ZN6Circle4areaEv
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+#include <typeinfo>
+
+class Shape {
+public:
+	virtual ~Shape() {}
+	virtual int area(void) {return 0;}
+};
+
+class Square : public Shape {
+public:
+	virtual int area(void) {return 4;}
+};
+
+class Circle : public Shape {
+public:
+	virtual int area(void) {return 3;}
+};
+
+static int area(Shape* s) {
+	if (Square* square = dynamic_cast<Square*>(s))
+		return square->area();
+	if (typeid(*s) == typeid(Circle))
+		return s->area() * 10;
+	return s->area() - 1;
+}
+
+int main(int argc, char** args) {
+	Square square;
+	Circle circle;
+	Shape shape;
+	return area(&square) == 4 && area(&circle) == 30 && area(&shape) == -1
+	       ? 0 : 1;
+}
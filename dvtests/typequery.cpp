@@ -0,0 +1,54 @@
+/*
+ * typequery.cpp
+ *
+ * A message dispatcher that switches on the dynamic type. Ping and Pong
+ * are leaves of a hierarchy closed with -devirt-whole-program, so
+ * dynamic_cast to them folds into a vtable pointer comparison, and the
+ * typeid comparisons into the same. The
+ * cast to Message always succeeds and folds away. Exits with 0 if every
+ * message is dispatched to its handler.
+ */
+
+// OPT: -mem2reg -devirt -devirt-whole-program
+// CHECK-LABEL: define {{.*}}@_ZL8dispatchP7Message(
+// CHECK-NOT: @__dynamic_cast
+// CHECK: icmp eq {{.*}}@_ZTV4Ping
+// CHECK-NOT: @_ZNKSt9type_infoeqERKS_
+// CHECK: icmp eq {{.*}}@_ZTV4Pong
+// CHECK-NOT: @_ZNKSt9type_infoeqERKS_
+
+#include <typeinfo>
+
+class Message {
+public:
+	virtual ~Message() {}
+	virtual int id(void) const {return 0;}
+};
+
+class Ping : public Message {
+public:
+	virtual int id(void) const {return 1;}
+};
+
+class Pong : public Message {
+public:
+	virtual int id(void) const {return 2;}
+};
+
+static int dispatch(Message* m) {
+	if (Ping* ping = dynamic_cast<Ping*>(m))
+		return 10 + ping->id();
+	if (typeid(*m) == typeid(Pong))
+		return 20 + m->id();
+	if (dynamic_cast<Message*>(m))
+		return m->id();
+	return -1;
+}
+
+int main(int argc, char** args) {
+	Ping ping;
+	Pong pong;
+	Message message;
+	return dispatch(&ping) == 11 && dispatch(&pong) == 22
+	       && dispatch(&message) == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+/*
+ * vbase.cpp
+ *
+ * Converting a new Diamond to its virtual base Base reads a virtual base
+ * offset that is known for the exact class and can be folded. Calling
+ * Base::value on it goes through a virtual thunk to Diamond::value, which
+ * reads a vcall offset from a secondary vtable: that load must not be
+ * folded. Exits with 0 if both calls see the right object.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define i32 @main(
+// CHECK-NOT: %vbase.offset{{[0-9]*}} = load
+// CHECK-LABEL: define {{.*}}@_ZTv0_n{{[0-9]+}}_NK7Diamond5valueEv(
+// CHECK: = load i64*
+
+class Base {
+public:
+	Base() : base(1) {}
+	virtual ~Base() {}
+	virtual int value(void) const {return base;}
+	int base;
+};
+
+class Left : public virtual Base {
+public:
+	Left() : left(10) {}
+	int left;
+};
+
+class Right : public virtual Base {
+public:
+	Right() : right(100) {}
+	int right;
+};
+
+class Diamond : public Left, public Right {
+public:
+	Diamond() : diamond(1000) {}
+	virtual int value(void) const {return base + left + right + diamond;}
+	int diamond;
+};
+
+static int valueOf(const Base* b) {
+	return b->value();
+}
+
+int main(int argc, char** args) {
+	Diamond* d = new Diamond();
+	Base* b = d;
+	int result = b->base == 1 ? 0 : 1;
+	result |= valueOf(b) != 1111;
+	result |= valueOf(static_cast<Right*>(d)) != 1111;
+	delete d;
+	return result;
+}
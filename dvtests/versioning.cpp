@@ -0,0 +1,45 @@
+/*
+ * versioning.cpp
+ *
+ * A loop whose receiver is invariant is specialized for the classes it may
+ * have: each copy calls Square::area or Circle::area directly. Exits with 0
+ * if every call reached the right method.
+ */
+
+// OPT: -mem2reg -loop-rotate -simplifycfg -indvars -loopsimplify -lcssa -devirt -devirt-whole-program
+// CHECK-LABEL: define {{.*}}@_ZL5totalPK5Shapei(
+// CHECK-DAG: call {{.*}}@_ZNK6Square4areaEv
+// CHECK-DAG: call {{.*}}@_ZNK6Circle4areaEv
+// CHECK-DAG: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+class Shape {
+public:
+	virtual ~Shape() {}
+	virtual int area(void) const = 0;
+};
+
+class Square : public Shape {
+public:
+	virtual int area(void) const {return 4;}
+};
+
+class Circle : public Shape {
+public:
+	virtual int area(void) const {return 3;}
+};
+
+static int total(const Shape* s, int n) {
+	int sum = 0;
+	for (int i = 0; i < n; ++i) {
+		sum += s->area();
+	}
+	return sum;
+}
+
+int main(int argc, char** args) {
+	Shape* s = argc > 1 ? (Shape*)new Circle() : (Shape*)new Square();
+	const int expected = argc > 1 ? 3000 : 4000;
+	const int sum = total(s, 1000);
+	delete s;
+	return sum == expected ? 0 : 1;
+}
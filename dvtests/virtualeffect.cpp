@@ -0,0 +1,40 @@
+/*
+ * virtualeffect.cpp
+ *
+ * The call to name() in the loop stays virtual, since both classes override
+ * it, but every overrider only reads memory. With the hierarchy closed
+ * (-devirt-whole-program), the call is marked readonly, so GVN merges the
+ * repeated calls and LICM hoists them out of the loop. Exits with 0 if the
+ * result is unchanged.
+ */
+
+// OPT: -mem2reg -loop-rotate -devirt -devirt-whole-program -gvn -licm
+// CHECK-LABEL: define {{.*}}@_ZL4hashPK4Basei(
+// CHECK: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}({{.*}}) {{readnone|readonly}}
+// CHECK-NOT: call {{[^@]*}}%{{[-a-zA-Z$._0-9]+}}(
+
+class Base {
+public:
+	virtual ~Base() {}
+	virtual char name(void) const {return '0';}
+};
+
+class Child : public Base {
+public:
+	virtual char name(void) const {return '1';}
+};
+
+static int hash(const Base* base, int n) {
+	int total = 0;
+	for (int i = 0; i < n; ++i)
+		total += base->name() + base->name() * 2;
+	return total;
+}
+
+int main(int argc, char** args) {
+	Base base;
+	Child child;
+	const Base* const chosen = argc > 1 ? &base : &child;
+	const int expected = argc > 1 ? 10 * 3 * '0' : 10 * 3 * '1';
+	return hash(chosen, 10) == expected ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+/*
+ * vptrreuse.cpp
+ *
+ * Every call through s loads the vtable pointer of the same object, and
+ * nothing in between can change it, so each load is replaced by the first
+ * one. The loads are visited in layout order, which the loop and the
+ * branches make differ from dominance order: a load already replaced must
+ * not be picked as the replacement of another. Exits with 0 if every call
+ * reaches the right method.
+ */
+
+// OPT: -mem2reg -devirt
+// CHECK-LABEL: define {{.*}}@_ZL5countP5Shapei(
+// CHECK: %vtable = load
+// CHECK-NOT: %vtable{{[0-9]+}} = load
+
+class Shape {
+public:
+	virtual ~Shape() {}
+	virtual int sides(void) {return 0;}
+	virtual int corners(void) {return 0;}
+};
+
+class Square : public Shape {
+public:
+	virtual int sides(void) {return 4;}
+	virtual int corners(void) {return 4;}
+};
+
+static int count(Shape* s, int n) {
+	int total = s->sides();
+	for (int i = 0; i < n; ++i) {
+		if (i % 2)
+			total += s->corners();
+		else
+			total += s->sides();
+	}
+	return total + s->corners();
+}
+
+int main(int argc, char** args) {
+	Square square;
+	Shape shape;
+	return count(&square, 5) == 28 && count(&shape, 5) == 0 ? 0 : 1;
+}
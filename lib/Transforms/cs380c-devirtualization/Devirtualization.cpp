@@ -6,23 +6,42 @@
  */
 
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/ValueMap.h"
 #include "llvm/Function.h"
 #include "llvm/Module.h"
+#include "llvm/TypeSymbolTable.h"
 #include "llvm/Pass.h"
 #include "llvm/Instructions.h"
 #include "llvm/LLVMContext.h"
+#include "llvm/Operator.h"
 
 #include "llvm/Metadata.h"
 
 #include "llvm/DerivedTypes.h"
 #include "llvm/InstrTypes.h"
+#include "llvm/InlineAsm.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Intrinsics.h"
 
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/DebugInfo.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Support/InstIterator.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/IRBuilder.h"
 
+#include <algorithm>
 #include <string>
 
 #define foreach(T, L, i) for(T::iterator i = (L).begin(), __end = (L).end(); i != __end; i++)
@@ -32,6 +51,34 @@
 using namespace llvm;
 using namespace std;
 
+static cl::opt<unsigned> MaxLoopVersions("devirt-loop-versions", cl::init(2),
+  cl::desc("Maximum number of receiver classes a loop is specialized for"));
+static cl::opt<unsigned> MaxVersionedLoopSize("devirt-loop-version-size",
+  cl::init(200),
+  cl::desc("Maximum size, in instructions, of a loop versioned on its receiver"));
+static cl::opt<bool> WholeProgram("devirt-whole-program", cl::init(false),
+  cl::desc("Assume the module defines every class deriving from its classes, "
+           "except those listed by -devirt-extensible"));
+static cl::list<string> ExtensibleClasses("devirt-extensible",
+  cl::CommaSeparated, cl::value_desc("class"),
+  cl::desc("Classes (by name or mangled name) that code outside the module, "
+           "e.g. plugins, may derive from"));
+static cl::opt<bool> UseRTTI("devirt-rtti", cl::init(true),
+  cl::desc("Without debug info, build the class hierarchy from vtables and "
+           "type_info objects"));
+static cl::opt<bool> CheckAssumedTypes("devirt-check-assumed-types",
+  cl::init(false),
+  cl::desc("Trap when the receiver of a call devirtualized on a dynamic type "
+           "asserted in the source is of another class"));
+static cl::opt<bool> PartitionLoops("devirt-partition-loops", cl::init(true),
+  cl::desc("Group the iterations of loops over arrays of objects by class"));
+static cl::opt<unsigned> MaxPartitions("devirt-partitions", cl::init(4),
+  cl::desc("Maximum number of classes a loop's iterations are grouped into"));
+static cl::opt<unsigned> PartitionStackSize("devirt-partition-stack",
+  cl::init(256),
+  cl::desc("Number of elements a partitioned loop sorts in a stack buffer "
+           "rather than a heap one"));
+
 namespace {
 struct FunctionMetadata {
   Function* Func;
@@ -43,6 +90,45 @@ struct FunctionMetadata {
   DIType Type;
 };
 
+/*
+ * Reads an offset-to-top (or vcall/vbase offset) entry of a vtable
+ */
+bool GetVTableOffset(const Constant* Entry, int64_t& Offset) {
+  if (Entry->isNullValue()) {
+    Offset = 0;
+    return true;
+  }
+  if (const ConstantExpr* const CE = dyn_cast<ConstantExpr>(Entry)) {
+    if (CE->getOpcode() == Instruction::IntToPtr) {
+      if (const ConstantInt* const CI = dyn_cast<ConstantInt>(CE->getOperand(0))) {
+        Offset = CI->getSExtValue();
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/*
+ * Whether two method types take the same parameters, so that methods of the
+ * same name with these types override one another. Return types are not
+ * compared: an override may return a pointer or reference to a class derived
+ * from the one the overridden method returns (covariant return type)
+ */
+bool SameParameters(const DIType& A, const DIType& B) {
+  if (A == B) { return true; }
+  if (!A.isCompositeType() || !B.isCompositeType()) { return false; }
+  const DIArray ATypes = DICompositeType(A).getTypeArray();
+  const DIArray BTypes = DICompositeType(B).getTypeArray();
+  if (ATypes.getNumElements() == 0
+      || ATypes.getNumElements() != BTypes.getNumElements())
+    { return false; }
+  for (unsigned i = 1; i < ATypes.getNumElements(); ++i) {
+    if (ATypes.getElement(i) != BTypes.getElement(i)) { return false; }
+  }
+  return true;
+}
+
 /*
  * Abstraction over class types encountered in metadata. Provides a list of methods
  * declared in the class, plus its parent and child classes
@@ -52,21 +138,74 @@ public:
   typedef llvm::SmallPtrSet<Class*, 3> ClassSet;
   typedef llvm::SmallPtrSet<FunctionMetadata*, 5> FunctionSet;
 
+  /*
+   * A DW_TAG_inheritance entry: the parent, its offset as recorded by the
+   * frontend and its DIDescriptor flags (access and virtuality). The offset
+   * of a non-virtual base is in bits; for a virtual base it is the distance
+   * in bytes below the class' address point of the vtable entry holding the
+   * base's offset.
+   */
+  struct BaseSpecifier {
+    Class* Base;
+    uint64_t Offset;
+    unsigned Flags;
+
+    bool isPublic(void) const {
+      return !(Flags & (DIDescriptor::FlagPrivate | DIDescriptor::FlagProtected));
+    }
+    bool isVirtual(void) const {return Flags & DIDescriptor::FlagVirtual;}
+  };
+  typedef vector<BaseSpecifier> BaseList;
+
+  /*
+   * An address point of the class' vtable: the index a vptr points to and
+   * the offset-to-top of the subobjects using it
+   */
+  struct AddressPoint {
+    unsigned Index;
+    int64_t OffsetToTop;
+  };
+  typedef SmallVector<AddressPoint, 1> AddressPointList;
+
+  /*
+   * A base class subobject in a complete object: its class, its offset in
+   * bits, whether it is a virtual base (shared by all the subobjects naming
+   * it) and the subobjects it is a direct base of
+   */
+  typedef SmallVector<unsigned, 4> IndexList;
+  struct Subobject {
+    Class* C;
+    int64_t Offset;
+    bool Virtual;
+    IndexList Containers;
+  };
+  typedef vector<Subobject> SubobjectList;
+
 protected:
   StringRef name;
+  string mangledName;
 
   ClassSet parents, children;
+  BaseList bases;
   FunctionSet methods;
 
+  GlobalVariable* vtable;
+  GlobalVariable* typeInfo;
+  AddressPointList addressPoints;
+  unsigned pointerSize;
+
 public:
   Class(const StringRef& classname, const ClassSet& supers = ClassSet(),
 			 const ClassSet& subs = ClassSet(), const FunctionSet& funcs = FunctionSet())
-  : name(classname), parents(supers), children(subs), methods(funcs)
+  : name(classname), parents(supers), children(subs), methods(funcs),
+    vtable(NULL), typeInfo(NULL), pointerSize(8)
   {}
 
   Class(const Class& other)
-  : name(other.name), parents(other.parents), children(other.children),
-    methods(other.methods)
+  : name(other.name), mangledName(other.mangledName), parents(other.parents),
+    children(other.children), bases(other.bases), methods(other.methods),
+    vtable(other.vtable), typeInfo(other.typeInfo),
+    addressPoints(other.addressPoints), pointerSize(other.pointerSize)
   {}
 
   virtual ~Class() {}
@@ -96,8 +235,288 @@ public:
     return false;
   }
 
+  /**
+   * Collects this class and every class derived from it
+   */
+  void getDescendants(ClassSet& Descendants) {
+    if (!Descendants.insert(this)) { return; }
+    foreach (ClassSet, children, C) {
+      (*C)->getDescendants(Descendants);
+    }
+  }
+
+  bool hasVirtualBases(void) const {
+    foreachI (BaseList, bases, B, const_iterator) {
+      if (B->isVirtual() || B->Base->hasVirtualBases()) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * Computes the offset in bits of the Base subobject in an object of this
+   * class. Fails if Base is not a base, is ambiguous or is reached through a
+   * virtual base (whose offset depends on the most derived class)
+   */
+  bool getBaseOffset(Class* const Base, int64_t& Offset) {
+    if (this == Base) {
+      Offset = 0;
+      return true;
+    }
+    bool Found = false;
+    foreach (BaseList, bases, B) {
+      if (!B->Base->isSubclassOf(Base)) { continue; }
+      int64_t BaseOffset;
+      if (Found || B->isVirtual() || !B->Base->getBaseOffset(Base, BaseOffset)) {
+        return false;
+      }
+      Offset = B->Offset + BaseOffset;
+      Found = true;
+    }
+    return Found;
+  }
+
+  /**
+   * Whether every inheritance path from this class up to C is public, so a
+   * C subobject can be converted to this class (e.g. by dynamic_cast)
+   */
+  bool isPublicSubclassOf(Class* C) {
+    if (this == C) { return true; }
+    bool Found = false;
+    foreach (BaseList, bases, B) {
+      if (B->Base->isSubclassOf(C)) {
+        if (!B->isPublic() || !B->Base->isPublicSubclassOf(C)) { return false; }
+        Found = true;
+      }
+    }
+    return Found;
+  }
+
   const StringRef getName(void) const {return name;}
 
+  /**
+   * The Itanium mangling of the class name, e.g. "4Base" or
+   * "N12_GLOBAL__N_11AE", or the empty string if it is not known
+   */
+  const string& getMangledName(void) const {return mangledName;}
+  void setMangledName(const string& mangled) {mangledName = mangled;}
+
+  const BaseList& getBases(void) const {return bases;}
+  BaseList& getBases(void) {return bases;}
+
+  GlobalVariable* getVTable(void) const {return vtable;}
+  GlobalVariable* getTypeInfo(void) const {return typeInfo;}
+  const AddressPointList& getAddressPoints(void) const {return addressPoints;}
+  unsigned getPointerSize(void) const {return pointerSize;}
+
+  /**
+   * Records the vtable and type_info object of the class, and finds the
+   * address points in the vtable's initializer (the entries following an
+   * offset-to-top and a pointer to the type_info). PointerSize is the size
+   * in bytes of a vtable entry
+   */
+  void setVTable(GlobalVariable* const VT, GlobalVariable* const TI,
+                 const unsigned PointerSize) {
+    vtable = VT;
+    typeInfo = TI;
+    pointerSize = PointerSize;
+    addressPoints.clear();
+    if (!VT || !TI || !VT->hasDefinitiveInitializer()) { return; }
+    const ConstantArray* const Entries =
+      dyn_cast<ConstantArray>(VT->getInitializer());
+    if (!Entries) { return; }
+    for (unsigned i = 2; i < Entries->getNumOperands(); ++i) {
+      AddressPoint AP = {i, 0};
+      if (Entries->getOperand(i - 1)->stripPointerCasts() == TI
+          && GetVTableOffset(Entries->getOperand(i - 2), AP.OffsetToTop)) {
+        addressPoints.push_back(AP);
+      }
+    }
+  }
+
+  /**
+   * Returns the address point used by the subobjects at the given offset (in
+   * bits) from the start of an object of this class, or NULL
+   */
+  const AddressPoint* getAddressPointFor(const int64_t Offset) const {
+    foreachI (AddressPointList, addressPoints, AP, const_iterator) {
+      if (AP->OffsetToTop * 8 == -Offset) { return &*AP; }
+    }
+    return NULL;
+  }
+
+  /**
+   * Reads the offset (in bits, from the start of an object of this class) of
+   * a virtual base of the subobject at SubobjectOffset, given the distance
+   * in bytes below that subobject's address point of the entry holding it
+   */
+  bool getVirtualBaseOffset(const int64_t SubobjectOffset,
+                            const uint64_t EntryOffset, int64_t& Offset) const {
+    const AddressPoint* const AP = getAddressPointFor(SubobjectOffset);
+    int64_t Bytes;
+    if (!AP || !getVTableOffsetEntry(*AP, -(int64_t)EntryOffset, Bytes)) {
+      return false;
+    }
+    Offset = SubobjectOffset + Bytes * 8;
+    return true;
+  }
+
+  /**
+   * Reads the offset entry (offset-to-top, vbase or vcall offset) at
+   * ByteOffset from an address point of the vtable
+   */
+  bool getVTableOffsetEntry(const AddressPoint& AP, const int64_t ByteOffset,
+                            int64_t& Entry) const {
+    const int64_t Index = AP.Index + ByteOffset / (int64_t)pointerSize;
+    const ConstantArray* const Entries =
+      cast<ConstantArray>(vtable->getInitializer());
+    if (ByteOffset % (int64_t)pointerSize || Index < 0
+        || Index >= Entries->getNumOperands())
+      { return false; }
+    return GetVTableOffset(Entries->getOperand(Index), Entry);
+  }
+
+  /**
+   * Lays out the base class subobjects of a complete object of this class.
+   * The first is the object itself. Fails if the offset of a virtual base
+   * cannot be read from the vtable
+   */
+  bool getSubobjects(SubobjectList& Subobjects) {
+    Subobjects.clear();
+    const Subobject Complete = {this, 0, false};
+    Subobjects.push_back(Complete);
+    DenseMap<Class*, unsigned> VirtualBases;
+    return addBaseSubobjects(0, Subobjects, VirtualBases);
+  }
+
+protected:
+  /**
+   * Adds the bases of subobject Index, sharing the virtual ones
+   */
+  bool addBaseSubobjects(const unsigned Index, SubobjectList& Subobjects,
+                         DenseMap<Class*, unsigned>& VirtualBases) {
+    Class* const C = Subobjects[Index].C;
+    const int64_t Offset = Subobjects[Index].Offset;
+    foreach (BaseList, C->bases, B) {
+      Subobject Base = {B->Base, Offset + (int64_t)B->Offset, B->isVirtual()};
+      if (B->isVirtual()) {
+        if (VirtualBases.count(B->Base)) {
+          Subobjects[VirtualBases.lookup(B->Base)].Containers.push_back(Index);
+          continue;
+        }
+        if (!getVirtualBaseOffset(Offset, B->Offset, Base.Offset)) {
+          return false;
+        }
+        VirtualBases[B->Base] = Subobjects.size();
+      }
+      Base.Containers.push_back(Index);
+      Subobjects.push_back(Base);
+      if (!addBaseSubobjects(Subobjects.size() - 1, Subobjects, VirtualBases)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  /**
+   * Whether subobject Inner is part of subobject Outer (or is Outer)
+   */
+  static bool isPartOf(const SubobjectList& Subobjects, const unsigned Inner,
+                       const unsigned Outer) {
+    if (Inner == Outer) { return true; }
+    foreachI (IndexList, Subobjects[Inner].Containers, C,
+              const_iterator) {
+      if (isPartOf(Subobjects, *C, Outer)) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * Finds the only subobject of class C, failing if there is none or several
+   */
+  static bool findSubobject(const SubobjectList& Subobjects, Class* const C,
+                            unsigned& Index) {
+    bool Found = false;
+    for (unsigned i = 0; i < Subobjects.size(); ++i) {
+      if (Subobjects[i].C != C) { continue; }
+      if (Found) { return false; }
+      Index = i;
+      Found = true;
+    }
+    return Found;
+  }
+
+  bool declares(const StringRef name, const DIType& type) const {
+    foreachI (FunctionSet, methods, i, const_iterator) {
+      if ((*i)->Name == name && SameParameters((*i)->Type, type)) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * Returns the final overrider, in a complete object of this class, of the
+   * virtual method with the given signature called through subobject Via,
+   * and the subobject it belongs to (which its this points to). Returns NULL
+   * if the method is not found or has no unique final overrider.
+   */
+  FunctionMetadata* getFinalOverrider(const SubobjectList& Subobjects,
+                                      const unsigned Via, const StringRef name,
+                                      const DIType& type, unsigned& Overrider) {
+    // The subobject the called method is looked up in: the nearest part of Via
+    // declaring it, which must be unique
+    IndexList Found;
+    for (unsigned i = 0; i < Subobjects.size(); ++i) {
+      if (isPartOf(Subobjects, i, Via) && Subobjects[i].C->declares(name, type)) {
+        Found.push_back(i);
+      }
+    }
+    unsigned Declaring = 0;
+    unsigned NumDeclaring = 0;
+    foreach (IndexList, Found, i) {
+      bool Hidden = false;
+      foreach (IndexList, Found, j) {
+        Hidden |= *i != *j && isPartOf(Subobjects, *i, *j);
+      }
+      if (!Hidden) {
+        Declaring = *i;
+        ++NumDeclaring;
+      }
+    }
+    if (NumDeclaring != 1) { return NULL; }
+
+    // Its final overrider: the declaration in the subobjects containing it
+    // that is not itself overridden in a subobject containing it (which may
+    // be on another path, through a virtual base)
+    FunctionMetadata* Final = NULL;
+    for (unsigned i = 0; i < Subobjects.size(); ++i) {
+      if (!isPartOf(Subobjects, Declaring, i)
+          || !Subobjects[i].C->declares(name, type))
+        { continue; }
+      bool Overridden = false;
+      for (unsigned j = 0; j < Subobjects.size(); ++j) {
+        Overridden |= j != i && isPartOf(Subobjects, i, j)
+                      && Subobjects[j].C->declares(name, type);
+      }
+      if (Overridden) { continue; }
+      if (Final) { return NULL; }
+      Final = Subobjects[i].C->getMethod(name, type);
+      Overrider = i;
+    }
+    return Final;
+  }
+
+  /**
+   * The value a vptr holds when it points at the given address point
+   */
+  Constant* getAddressPointValue(const AddressPoint& AP) const {
+    const Type* const Int64Ty = Type::getInt64Ty(vtable->getContext());
+    Constant* const Indices[2] = {
+      ConstantInt::get(Int64Ty, 0),
+      ConstantInt::get(Int64Ty, AP.Index),
+    };
+    return ConstantExpr::getInBoundsGetElementPtr(vtable, Indices, 2);
+  }
+
   const ClassSet& getChildren(void) const {return children;}
   ClassSet& getChildren(void) {return children;}
 
@@ -109,23 +528,29 @@ public:
 
   /**
    * Returns the metadata for the method that would be called
-   * when needing a virtual function with the given signature (name and type)
+   * when needing a virtual function with the given signature (name and type):
+   * the declaration in this class or, among its bases, the one no other base
+   * declaring it derives from. Returns NULL if bases declare it on unrelated
+   * paths, which needs the subobject to decide (see getFinalOverrider)
    */
   FunctionMetadata* getMethod(const StringRef name, const DIType& type) const {
     foreach (FunctionSet, methods, i) {
     	FunctionMetadata* const method = *i;
-      if (method->Name == name && method->Type == type) {
+      if (method->Name == name && SameParameters(method->Type, type)) {
         return method;
       }
     }
+    FunctionMetadata* found = NULL;
     foreach (ClassSet, parents, p) {
-      if ((*p) != this) {
-        if (FunctionMetadata* const method = (*p)->getMethod(name, type)) {
-          return method;
-        }
+      if ((*p) == this) { continue; }
+      FunctionMetadata* const method = (*p)->getMethod(name, type);
+      if (!method || method == found) { continue; }
+      if (found) {
+        return NULL;
       }
+      found = method;
     }
-    return NULL;
+    return found;
   }
 
   void dump(void) const {
@@ -149,14 +574,101 @@ public:
 typedef llvm::SmallPtrSet<FunctionMetadata*, 3> MDSet;
 typedef DenseMap<FunctionMetadata*,MDSet> SignatureEquSetMap;
 
-FunctionMetadata FromSubprogram(DISubprogram Subprogram) {
-  StringRef LinkageName = Subprogram.getLinkageName();
-  if (LinkageName.empty()) {
-    LinkageName = Subprogram.getName();
+/*
+ * Splits the Itanium mangled name of a member function, e.g. _ZNK4Base4nameEv,
+ * into the mangled name of its class ("4Base") and the rest of the name, i.e.
+ * qualifiers, unqualified name and parameters ("K4nameEv"). Only understands
+ * nested names made of plain identifiers, constructors, destructors and
+ * operators; returns false for anything else (templates, substitutions...)
+ */
+bool SplitMangledMethodName(const StringRef LinkageName, string& ClassName,
+                            string& Signature, StringRef* const Method = NULL) {
+  if (!LinkageName.startswith("_ZN")) { return false; }
+  const size_t Size = LinkageName.size();
+  size_t Pos = 3;
+  string Qualifiers;
+  while (Pos < Size && (LinkageName[Pos] == 'K' || LinkageName[Pos] == 'V'
+                        || LinkageName[Pos] == 'r')) {
+    Qualifiers += LinkageName[Pos++];
+  }
+
+  vector<StringRef> Components;
+  while (Pos < Size && LinkageName[Pos] != 'E') {
+    const size_t Start = Pos;
+    const char C = LinkageName[Pos];
+    if (isdigit(C)) {
+      size_t Length = 0;
+      while (Pos < Size && isdigit(LinkageName[Pos])) {
+        Length = Length * 10 + (LinkageName[Pos++] - '0');
+      }
+      Pos += Length;
+    } else if ((C == 'C' || C == 'D') && Pos + 1 < Size
+               && isdigit(LinkageName[Pos + 1])) {
+      Pos += 2; // constructor or destructor
+    } else if (islower(C) && C != 'c' && Pos + 1 < Size
+               && isalpha(LinkageName[Pos + 1])) {
+      Pos += 2; // operator
+    } else {
+      return false;
+    }
+    if (Pos > Size) { return false; }
+    Components.push_back(LinkageName.slice(Start, Pos));
+  }
+  if (Pos >= Size || Components.size() < 2) { return false; }
+
+  if (Components.size() == 2) {
+    ClassName = Components.front().str();
+  } else {
+    ClassName = "N";
+    for (size_t i = 0; i + 1 < Components.size(); ++i) {
+      ClassName += Components[i].str();
+    }
+    ClassName += "E";
+  }
+  Signature = Qualifiers + Components.back().str()
+              + LinkageName.substr(Pos + 1).str();
+  if (Method) { *Method = Components.back(); }
+  return true;
+}
+
+/*
+ * Returns the unqualified name of a class from its mangled name, e.g. "B"
+ * for "1B" or "N2ns1BE", or the mangled name if it is not that simple
+ */
+StringRef GetUnqualifiedClassName(const StringRef Mangled) {
+  size_t Pos = Mangled.startswith("N") ? 1 : 0;
+  StringRef Last;
+  while (Pos < Mangled.size() && isdigit(Mangled[Pos])) {
+    size_t Length = 0;
+    while (Pos < Mangled.size() && isdigit(Mangled[Pos])) {
+      Length = Length * 10 + (Mangled[Pos++] - '0');
+    }
+    Last = Mangled.substr(Pos, Length);
+    Pos += Length;
+  }
+  const bool Complete = Mangled.startswith("N") ? Pos + 1 == Mangled.size()
+                                                : Pos == Mangled.size();
+  return Complete && !Last.empty() ? Last : Mangled;
+}
+
+/*
+ * Builds the metadata of a function from its debug info, keyed by
+ * LinkageName. Destructors are named after their class, so they get the name
+ * of their variant in the linkage name instead ("D0" deleting, "D1" complete,
+ * "D2" base object), which is what the destructors overriding them share
+ */
+FunctionMetadata FromSubprogram(DISubprogram Subprogram,
+                                const StringRef LinkageName) {
+  StringRef Name = Subprogram.getName();
+  string ClassName, Signature;
+  StringRef Variant;
+  if (Name.startswith("~")
+      && SplitMangledMethodName(LinkageName, ClassName, Signature, &Variant)) {
+    Name = Variant;
   }
   FunctionMetadata MD = {
     Subprogram.getFunction(),
-    Subprogram.getName(),
+    Name,
     LinkageName,
     Subprogram.getVirtuality(),
     Subprogram.getVirtualIndex(),
@@ -166,12 +678,217 @@ FunctionMetadata FromSubprogram(DISubprogram Subprogram) {
   return MD;
 }
 
+/*
+ * Whether debug info describes a class: classes declared with struct are
+ * just as polymorphic as those declared with class
+ */
+bool IsClassType(const DIDescriptor& D) {
+  return D.Verify() && (D.getTag() == dwarf::DW_TAG_class_type
+                        || D.getTag() == dwarf::DW_TAG_structure_type);
+}
+
+/*
+ * Returns the mangled name of a class from its debug info, e.g. "4Base" or
+ * "N2ns4BaseE", or an empty string if it is not named by identifiers only
+ * (templates, local classes...)
+ */
+string GetMangledClassName(const DIType& Type) {
+  vector<string> Names;
+  Names.push_back(Type.getName());
+  DIDescriptor Context = Type.getContext();
+  while (Context.Verify() && !Context.isCompileUnit() && !Context.isFile()) {
+    if (Context.isNameSpace()) {
+      const DINameSpace NameSpace(Context);
+      Names.push_back(NameSpace.getName().empty() ? "_GLOBAL__N_1"
+                                                  : NameSpace.getName().str());
+      Context = NameSpace.getContext();
+    } else if (IsClassType(Context)) {
+      const DIType Outer(Context);
+      Names.push_back(Outer.getName());
+      Context = Outer.getContext();
+    } else {
+      return "";
+    }
+  }
+
+  string Mangled;
+  for (vector<string>::reverse_iterator i = Names.rbegin(); i != Names.rend();
+       ++i) {
+    if (i->empty()) { return ""; }
+    foreachI (string, *i, c, const_iterator) {
+      if (!isalnum(*c) && *c != '_') { return ""; }
+    }
+    Mangled += utostr(i->size()) + *i;
+  }
+  return Names.size() > 1 ? "N" + Mangled + "E" : Mangled;
+}
+
 struct CallEdge {
   FunctionMetadata* ToFunc;
   bool isVirtual;
   bool Unknown;
 };
 
+/*
+ * What is known about the dynamic type of an object: either its exact class,
+ * or a class it must be derived from. C is NULL when nothing is known.
+ */
+struct TypeFact {
+  Class* C;
+  bool Exact;
+};
+
+/*
+ * The adjustments, in bits, a thunk would make when a virtual call reaches
+ * its target through it: to the this pointer before the call, and to the
+ * returned pointer after it (covariant return types)
+ */
+struct ThunkAdjustment {
+  int64_t This;
+  int64_t Return;
+};
+
+/*
+ * Where the receiver of a virtual call comes from, as annotated by the
+ * frontend in the virtual-call metadata
+ */
+enum ReceiverKind {
+  ReceiverThis,
+  ReceiverParameter,
+  ReceiverField,
+  ReceiverLocal,
+  ReceiverNew,
+  ReceiverUnknown
+};
+
+/*
+ * Returns the object pointer ("this") passed to a member function call
+ */
+Value* GetReceiver(const CallInst* const Call) {
+  if (Call->getNumArgOperands() > 1 && Call->paramHasAttr(1, Attribute::StructRet)) {
+    return Call->getArgOperand(1);
+  }
+  return Call->getArgOperand(0);
+}
+
+/*
+ * Whether a linkage name is the name of a constructor or destructor, which
+ * may change the vtable pointer of the object they are called on
+ */
+bool IsConstructorOrDestructor(const StringRef LinkageName) {
+  string ClassName, Signature;
+  return SplitMangledMethodName(LinkageName, ClassName, Signature)
+         && Signature.size() > 1 && (Signature[0] == 'C' || Signature[0] == 'D')
+         && isdigit(Signature[1]);
+}
+
+/*
+ * Whether a linkage name is the name of a thunk, whose this points to another
+ * subobject than its type says until it adjusts it
+ */
+bool IsThunk(const StringRef LinkageName) {
+  return LinkageName.startswith("_ZTh") || LinkageName.startswith("_ZTv")
+         || LinkageName.startswith("_ZTc");
+}
+
+typedef SmallVector<BasicBlock*, 8> BlockVector;
+
+/*
+ * Calls with the receivers they were made on before devirtualization, which
+ * may have adjusted them
+ */
+typedef vector<pair<CallInst*, Value*> > CallReceiverList;
+
+/*
+ * A loop to specialize for the dynamic classes of a loop-invariant receiver:
+ * the virtual calls on the receiver, and the classes to make copies for
+ */
+struct LoopVersioning {
+  Loop* L;
+  Value* Receiver;
+  Class* Static;
+  vector<CallInst*> Calls;
+  vector<Class*> Versions;
+};
+
+/*
+ * A loop over an array of objects making one readonly virtual call per
+ * element, whose results are combined by an associative and commutative
+ * operation. Its iterations can be reordered so that elements of the same
+ * class are processed together.
+ */
+struct LoopPartitioning {
+  Loop* L;
+  PHINode* Index;
+  Value* Count;
+  CallInst* Call;
+  Instruction* ResultCast;
+  BinaryOperator* Reduction;
+  PHINode* Accumulator;
+  Class* Static;
+  vector<Class*> Buckets;
+};
+
+/*
+ * Makes a call direct, casting F to the type of the original callee if the
+ * target expects a different this type
+ */
+void SetDirectCallee(CallInst* const Call, Function* const F) {
+  const Type* const CalleeTy = Call->getCalledValue()->getType();
+  if (F->getType() == CalleeTy) {
+    Call->setCalledFunction(F);
+  } else {
+    Call->setCalledFunction(ConstantExpr::getBitCast(F, CalleeTy));
+  }
+}
+
+/*
+ * Returns the function a call is direct to, through the cast SetDirectCallee
+ * may have added, or NULL for indirect calls
+ */
+const Function* GetDirectCallee(const CallInst* const Call) {
+  return dyn_cast<Function>(Call->getCalledValue()->stripPointerCasts());
+}
+
+/*
+ * Offsets a pointer by a number of bits (a multiple of 8), keeping its type
+ */
+Value* AdjustPointer(Value* const Ptr, const int64_t Bits,
+                     Instruction* const InsertBefore) {
+  LLVMContext& Context = Ptr->getContext();
+  Value* const Bytes = new BitCastInst(Ptr, Type::getInt8PtrTy(Context), "",
+                                       InsertBefore);
+  Value* const Offset = ConstantInt::get(Type::getInt64Ty(Context), Bits / 8);
+  Value* const Adjusted = GetElementPtrInst::CreateInBounds(Bytes, Offset,
+    Ptr->getName() + ".adj", InsertBefore);
+  return new BitCastInst(Adjusted, Ptr->getType(), "", InsertBefore);
+}
+
+/*
+ * What a call may do to memory visible to its caller. Ordered so that the
+ * effect of calling one of several functions is the maximum of their effects.
+ */
+enum MemoryEffect {
+  ReadNone = 0,
+  ReadOnly = 1,
+  MayWrite = 2
+};
+
+/*
+ * Whether Ptr points into the stack frame of the function using it, so that
+ * accessing it is not visible to callers
+ */
+bool IsLocalMemory(const Value* Ptr) {
+  while (true) {
+    Ptr = Ptr->stripPointerCasts();
+    if (const GEPOperator* const GEP = dyn_cast<GEPOperator>(Ptr)) {
+      Ptr = GEP->getPointerOperand();
+      continue;
+    }
+    return isa<AllocaInst>(Ptr);
+  }
+}
+
 class DevirtualizationPass : public llvm::ModulePass {
 public:
   static char ID;
@@ -183,230 +900,2698 @@ public:
   DenseMap<FunctionMetadata*, MDSet> SignatureEquSets;
   DenseMap<FunctionMetadata*, MDSet> OverriddenByMap;
   DenseMap<FunctionMetadata*, vector<CallEdge> > CallGraph;
+  DenseMap<FunctionMetadata*, MemoryEffect> FunctionEffects;
+  DenseMap<FunctionMetadata*, MemoryEffect> SignatureEffects;
+  DenseMap<const Value*, Class*> TypeInfoToClass;
+  DenseMap<const Value*, Class*> VTableToClass;
+  StringMap<Class*> MangledToClass;
+  StringMap<Class*> NameToClass;
+  DenseMap<const Type*, unsigned> TypeNameCounts;
+  DenseMap<Class*, unsigned> AllocationCounts;
+  DenseMap<Class*, bool> ClosedClasses;
+  Class::ClassSet SealedClasses;
+  DominatorTree* DT;
 
-  DevirtualizationPass(void) : ModulePass(ID) {}
+  DevirtualizationPass(void) : ModulePass(ID), DT(NULL) {}
   virtual ~DevirtualizationPass(void) {
     // Clean up the pointers we new
     foreach (TypeMap, classes, i) {
       delete i->second;
     }
-    foreach (StringMap<FunctionMetadata*>, LinkageToMetadata, i) {
-      delete i->second;
+    foreach (StringMap<FunctionMetadata*>, LinkageToMetadata, i) {
+      delete i->second;
+    }
+  }
+
+  virtual void getAnalysisUsage(AnalysisUsage& AU) const {
+    AU.addRequired<DominatorTree>();
+    AU.addRequired<LoopInfo>();
+  }
+
+  virtual bool runOnModule(Module& m) {
+    if (!BuildHierarchy(m, getAnalysisIfAvailable<TargetData>())) {
+      return false;
+    }
+
+    // Build call graph
+    foreach (Module, m, f) {
+      foreach (Function, *f, bb) {
+        foreach (BasicBlock, *bb, i) {
+          if (CallInst* const Call = dyn_cast<CallInst>(&*i)) {
+            UpdateCallGraph(Call, f);
+          }
+        }
+      }
+    }
+    // Count the objects of each class created in the module (calls to
+    // complete object constructors), as a static estimate of how likely a
+    // receiver is to have that class
+    foreach (Module, m, f) {
+      foreach (Function, *f, bb) {
+        foreach (BasicBlock, *bb, i) {
+          CallSite CS(&*i);
+          if (!CS.getInstruction()) { continue; }
+          if (Class* const C = GetConstructorClass(CS.getCalledFunction())) {
+            ++AllocationCounts[C];
+          }
+        }
+      }
+    }
+
+    /*#define XX DenseMap<FunctionMetadata*, vector<CallEdge> >
+    foreach (XX, CallGraph, X) {
+      FunctionMetadata* From = X->first;
+      ferrs() << From->LinkageName << "->\n";
+      foreach (vector<CallEdge>, X->second, Edge) {
+        ferrs() << "  " << (Edge->ToFunc?Edge->ToFunc->LinkageName:"?") << "\n";
+      }
+    }*/
+
+    bool changed = false;
+
+    // Fold the dynamic_casts and typeid comparisons the hierarchy decides
+    foreach (Module, m, i) {
+      changed |= FoldTypeQueries(*i);
+    }
+
+    // Run the devirtualization
+    foreach (Module, m, i) {
+      changed |= runOnFunction(*i);
+    }
+
+    // Fold the virtual base offsets read from vtables of known classes
+    foreach (Module, m, i) {
+      changed |= FoldVBaseOffsets(*i);
+    }
+
+    // Group the iterations of loops over arrays of objects by class
+    if (PartitionLoops) {
+      foreach (Module, m, i) {
+        changed |= PartitionLoopsByClass(*i);
+      }
+    }
+
+    // Specialize loops for the likely classes of their invariant receivers
+    foreach (Module, m, i) {
+      changed |= VersionLoops(*i);
+    }
+
+    // Reload the vtable pointer of an object only when it may have changed
+    foreach (Module, m, i) {
+      changed |= ReuseVTablePointerLoads(*i);
+    }
+
+    return changed;
+  }
+
+protected:
+  /**
+   * Builds the class hierarchy of a module, from its debug info or else its
+   * type_info objects, with the methods of each class, their vtables and the
+   * methods overriding each. Returns false if there is nothing to build it
+   * from. TD, if available, gives the size of vtable entries
+   */
+  bool BuildHierarchy(Module& m, const TargetData* const TD) {
+    const NamedMDNode* const sp = m.getNamedMetadata(Twine("llvm.dbg.sp"));
+    if (!sp && !UseRTTI) {
+      ferrs() << "No llvm.dbg.sp metadata found\n";
+      return false;
+    }
+
+    if (sp) {
+      BuildHierarchyFromDebugInfo(m, sp);
+    } else {
+      BuildHierarchyFromRTTI(m);
+    }
+
+    // Count the names of each IR type
+    const TypeSymbolTable& Types = m.getTypeSymbolTable();
+    foreachI (TypeSymbolTable, Types, i, const_iterator) {
+      ++TypeNameCounts[i->second];
+    }
+
+    // Associate functions with their defining classes
+    foreachI(StringMap<FunctionMetadata*>, LinkageToMetadata, i, const_iterator) {
+    	FunctionMetadata* const f = i->second;
+    	const TypeMap::iterator c = classes.find(f->ContainingType);
+    	/*ferrs() << "Found function " << f->Name << " (" << f->LinkageName
+				   << ") ";*/
+    	if (c != classes.end()) {
+    		Class* const C = c->second;
+    		/*ferrs() << "in class " << C->getName() << '\n';*/
+        C->getMethods().insert(f);
+    	} /*else {
+    		ferrs() << "WITH NO CLASS\n";
+    	}*/
+    }
+
+    /*for (TypeMap::const_iterator i = classes.begin(); i != classes.end(); ++i) {
+      ferrs() << "Found class (" << i->second << ") with hierarchy:\n";
+      (*i).second->dump();
+    }*/
+
+    // Find the vtable and type_info object of each class
+    foreach (TypeMap, classes, i) {
+      Class* const C = i->second;
+      foreach (Class::FunctionSet, C->getMethods(), f) {
+        string ClassName, Signature;
+        if (SplitMangledMethodName((*f)->LinkageName, ClassName, Signature)) {
+          C->setMangledName(ClassName);
+          break;
+        }
+      }
+      // Classes with the same unqualified name cannot be told apart by name
+      StringMap<Class*>::iterator Named = NameToClass.find(C->getName());
+      if (Named == NameToClass.end()) {
+        NameToClass[C->getName()] = C;
+      } else {
+        Named->second = NULL;
+      }
+      if (C->getMangledName().empty()) { continue; }
+      MangledToClass[C->getMangledName()] = C;
+      C->setVTable(m.getGlobalVariable("_ZTV" + C->getMangledName(), true),
+                   m.getGlobalVariable("_ZTI" + C->getMangledName(), true),
+                   TD ? TD->getPointerSize() : 8);
+      if (C->getTypeInfo()) {
+        TypeInfoToClass[C->getTypeInfo()] = C;
+      }
+      if (C->getVTable()) {
+        VTableToClass[C->getVTable()] = C;
+      }
+    }
+
+    // Find the roots of the hierarchies the frontend recorded as sealed
+    if (const NamedMDNode* const Sealed = m.getNamedMetadata("devirt.sealed")) {
+      for (unsigned i = 0; i < Sealed->getNumOperands(); ++i) {
+        const MDNode* const Root = Sealed->getOperand(i);
+        const MDString* const TypeInfoName = Root && Root->getNumOperands()
+          ? dyn_cast_or_null<MDString>(Root->getOperand(0)) : NULL;
+        if (!TypeInfoName || !TypeInfoName->getString().startswith("_ZTI")) {
+          continue;
+        }
+        Class* const C =
+          MangledToClass.lookup(TypeInfoName->getString().substr(4));
+        if (C && IsSealedHierarchyComplete(C)) {
+          SealedClasses.insert(C);
+        }
+      }
+    }
+
+    // Group functions by their signature
+    // (i.e. function signature equivalence sets)
+    foreach (StringMap<FunctionMetadata*>, LinkageToMetadata, MDIter) {
+      FunctionMetadata* MD = MDIter->second;
+      if (MDSet* v = GetOrCreateEquSet(MD)) {
+        v->insert(MD);
+      }
+    }
+
+    // Use class hierarchy and equivalence sets to identify overriden methods
+    foreach (StringMap<FunctionMetadata*>, LinkageToMetadata, MDIter) {
+      FunctionMetadata* MD = MDIter->second;
+      SetOverridenByFor(MD);
+    }
+    return true;
+  }
+
+  void UpdateCallGraph(const CallInst* const Call, Function* FromFunc) {
+    CallEdge callEdge = {NULL, false, false};
+    if (FunctionMetadata* const ToFunc = GetVirtualCallee(Call)) {
+      callEdge.isVirtual = true;
+      callEdge.ToFunc = ToFunc;
+    }
+    if (!callEdge.isVirtual) {
+      if (const Function* const Callee = GetDirectCallee(Call)) {
+        StringRef LinkageName = Callee->getName();
+        if (LinkageToMetadata.count(LinkageName)) {
+          callEdge.ToFunc = LinkageToMetadata[LinkageName];
+        }
+      } else {
+        callEdge.Unknown = true;
+      }
+    }
+    if (!callEdge.Unknown && !callEdge.ToFunc) {
+      return; // not a real function (e.g. @llvm.dbg.declare)
+    }
+    FunctionMetadata* FromFuncMD = LinkageToMetadata[FromFunc->getName()];
+    
+    if (!CallGraph.count(FromFuncMD)) {
+      vector<CallEdge> edges;
+      CallGraph.insert(pair<FunctionMetadata*, vector<CallEdge> >(
+        FromFuncMD,
+        edges
+      ));
+    }
+    CallGraph[FromFuncMD].push_back(callEdge);
+  }
+
+  /**
+   * Builds the class hierarchy and the methods' metadata from the debug info
+   * of the module, whose subprograms are listed by sp
+   */
+  void BuildHierarchyFromDebugInfo(Module& m, const NamedMDNode* const sp) {
+    // Build the map from linkage name's to metadata
+    for (size_t i=0; i < sp->getNumOperands(); ++i) {
+      const MDNode* const MD = sp->getOperand(i);
+      UpdateLinkageToMetadata(DISubprogram(MD));
+    }
+
+    // Get Functions from the module if the Function's not defined in the Module
+    foreach(StringMap<FunctionMetadata*>, LinkageToMetadata, i) {
+    	FunctionMetadata* const f = i->second;
+    	if (!f->Func) {
+    		f->Func = m.getFunction(f->LinkageName);
+    	}
+    }
+
+    // Build class hierarchy
+    for (size_t i=0; i < sp->getNumOperands(); ++i) {
+      const MDNode* const MD = sp->getOperand(i);
+      const DISubprogram Subprogram = DISubprogram(MD);
+      const DICompositeType type = Subprogram.getContainingType();
+      if (IsClassType(type)) {
+        getOrCreateHierarchy(type);
+      }
+    }
+
+    // Also the classes without methods of their own in llvm.dbg.sp, found
+    // through the types of variables, members and bases
+    DebugInfoFinder Finder;
+    Finder.processModule(m);
+    for (DebugInfoFinder::iterator i = Finder.type_begin();
+         i != Finder.type_end(); ++i) {
+      const DICompositeType type(*i);
+      if (IsClassType(type) && !type.isForwardDecl()) {
+        getOrCreateHierarchy(type);
+      }
+    }
+  }
+
+  /**
+   * Builds the class hierarchy of a module without debug info from its
+   * type_info objects, and the methods from the functions with member
+   * function names (virtual if they are found in a vtable or named by a
+   * virtual call). A class is keyed by a metadata node holding the name of
+   * its type_info, and a method's type by one holding its mangled
+   * qualifiers, name and parameters, which overriders share.
+   */
+  void BuildHierarchyFromRTTI(Module& m) {
+    DenseMap<const GlobalVariable*, Class*> Built;
+    for (Module::global_iterator G = m.global_begin(); G != m.global_end(); ++G) {
+      if (G->getName().startswith("_ZTI")) {
+        getOrCreateHierarchy(&*G, Built);
+      }
+    }
+
+    // The slot of each function in the first vtable it is found in, counted
+    // from the primary address point up to the type_info of the next
+    // (secondary) vtable
+    DenseMap<const Function*, unsigned> Slots;
+    for (Module::global_iterator G = m.global_begin(); G != m.global_end(); ++G) {
+      if (!G->getName().startswith("_ZTV") || !G->hasDefinitiveInitializer()) {
+        continue;
+      }
+      const ConstantArray* const Entries =
+        dyn_cast<ConstantArray>(G->getInitializer());
+      if (!Entries) { continue; }
+      unsigned AddressPoint = 0;
+      for (unsigned i = 1; i < Entries->getNumOperands(); ++i) {
+        const Value* const Entry = Entries->getOperand(i)->stripPointerCasts();
+        if (Entry->getName().startswith("_ZTI")) {
+          if (AddressPoint) { break; }
+          AddressPoint = i + 1;
+        } else if (const Function* const F = dyn_cast<Function>(Entry)) {
+          if (AddressPoint && !Slots.count(F)) {
+            Slots[F] = i - AddressPoint;
+          }
+        }
+      }
+    }
+
+    foreach (Module, m, F) {
+      AddMethodFromRTTI(m, F->getName(), &*F, Slots.count(&*F),
+                        Slots.lookup(&*F));
+    }
+
+    // Virtual methods found in no vtable, e.g. pure virtual ones
+    foreach (Module, m, f) {
+      foreach (Function, *f, bb) {
+        foreach (BasicBlock, *bb, i) {
+          const CallInst* const Call = dyn_cast<CallInst>(&*i);
+          const MDNode* const VirtualMD =
+            Call ? Call->getMetadata("virtual-call") : NULL;
+          if (!VirtualMD || GetDirectCallee(Call)) { continue; }
+          if (const MDString* const Name =
+                dyn_cast<MDString>(VirtualMD->getOperand(0))) {
+            AddMethodFromRTTI(m, Name->getString(),
+                              m.getFunction(Name->getString()), true, 0);
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   * The metadata node standing for a class built from its type_info
+   */
+  static MDNode* GetRTTIClassKey(LLVMContext& Context, const StringRef Mangled) {
+    Value* const Name = MDString::get(Context, "_ZTI" + Mangled.str());
+    return MDNode::get(Context, ArrayRef<Value*>(Name));
+  }
+
+  void AddMethodFromRTTI(Module& m, const StringRef LinkageName, Function* const F,
+                         const bool Virtual, const unsigned Slot) {
+    string ClassName, Signature;
+    StringRef Method;
+    if (LinkageToMetadata.count(LinkageName)
+        || !SplitMangledMethodName(LinkageName, ClassName, Signature, &Method)
+        || !MangledToClass.count(ClassName))
+      { return; }
+    LLVMContext& Context = m.getContext();
+    Value* const SignatureName = MDString::get(Context, Signature);
+    FunctionMetadata* const MD = new FunctionMetadata;
+    MD->Func = F;
+    MD->Name = Method;
+    MD->LinkageName = LinkageName;
+    MD->Virtuality = Virtual ? dwarf::DW_VIRTUALITY_virtual : 0;
+    MD->VirtualIndex = Slot;
+    MD->ContainingType = DICompositeType(GetRTTIClassKey(Context, ClassName));
+    MD->Type = DIType(MDNode::get(Context, ArrayRef<Value*>(SignatureName)));
+    LinkageToMetadata.GetOrCreateValue(LinkageName, MD);
+  }
+
+  /**
+   * Creates the class described by a type_info object and its bases, or
+   * returns NULL if it is not a class type_info or some base is not known
+   */
+  Class* getOrCreateHierarchy(const GlobalVariable* const TI,
+                              DenseMap<const GlobalVariable*, Class*>& Built) {
+    if (Built.count(TI)) { return Built.lookup(TI); }
+    Built[TI] = NULL;
+    if (!TI->hasDefinitiveInitializer()) { return NULL; }
+    const ConstantStruct* const Init =
+      dyn_cast<ConstantStruct>(TI->getInitializer());
+    const GEPOperator* const VPtr = Init && Init->getNumOperands() >= 2
+      ? dyn_cast<GEPOperator>(Init->getOperand(0)->stripPointerCasts()) : NULL;
+    if (!VPtr) { return NULL; }
+    const StringRef Kind = VPtr->getPointerOperand()->getName();
+
+    // __si_class_type_info has a single public base at offset 0;
+    // __vmi_class_type_info has flags, a base count and the bases, each with
+    // its offset shifted left by 8 and or'ed with 1 if virtual, 2 if public.
+    // The offset of a virtual base is that of its entry in the vtable
+    Class::ClassSet parents;
+    Class::BaseList bases;
+    if (Kind == "_ZTVN10__cxxabiv120__si_class_type_infoE") {
+      const GlobalVariable* const BaseTI = dyn_cast<GlobalVariable>(
+        Init->getOperand(2)->stripPointerCasts());
+      Class* const parent = BaseTI ? getOrCreateHierarchy(BaseTI, Built) : NULL;
+      if (!parent) { return NULL; }
+      const Class::BaseSpecifier base = {parent, 0, 0};
+      parents.insert(parent);
+      bases.push_back(base);
+    } else if (Kind == "_ZTVN10__cxxabiv121__vmi_class_type_infoE") {
+      for (unsigned i = 4; i + 1 < Init->getNumOperands(); i += 2) {
+        const GlobalVariable* const BaseTI = dyn_cast<GlobalVariable>(
+          Init->getOperand(i)->stripPointerCasts());
+        const ConstantInt* const OffsetFlags =
+          dyn_cast<ConstantInt>(Init->getOperand(i + 1));
+        Class* const parent = BaseTI ? getOrCreateHierarchy(BaseTI, Built) : NULL;
+        if (!parent || !OffsetFlags) { return NULL; }
+        const int64_t Offset = OffsetFlags->getSExtValue() >> 8;
+        const bool IsVirtual = OffsetFlags->getSExtValue() & 1;
+        const bool IsPublic = OffsetFlags->getSExtValue() & 2;
+        const Class::BaseSpecifier base = {
+          parent,
+          IsVirtual ? -Offset : Offset * 8,
+          (IsVirtual ? DIDescriptor::FlagVirtual : 0)
+            | (IsPublic ? 0 : DIDescriptor::FlagPrivate),
+        };
+        parents.insert(parent);
+        bases.push_back(base);
+      }
+    } else if (Kind != "_ZTVN10__cxxabiv117__class_type_infoE") {
+      return NULL;
+    }
+
+    const StringRef Mangled = TI->getName().substr(4);
+    Class* const c = new Class(GetUnqualifiedClassName(Mangled), parents);
+    c->getBases() = bases;
+    c->setMangledName(Mangled.str());
+    foreach (Class::ClassSet, parents, i) {
+      (*i)->getChildren().insert(c);
+    }
+    classes.insert(pair<MDNode*, Class*>(
+      GetRTTIClassKey(TI->getContext(), Mangled), c));
+    MangledToClass[Mangled] = c;
+    Built[TI] = c;
+    return c;
+  }
+
+  Class* getOrCreateHierarchy(const DICompositeType& type) {
+    const TypeMap::const_iterator typeClass = classes.find(type);
+    if (typeClass != classes.end()) {
+      Class * const c = typeClass->second;
+      /*ferrs() << "Existing class pointer for " << type.getName()
+              << " ("<< ((MDNode*)type) << ") is " << c << '\n';*/
+      return c;
+    }
+
+    // Otherwise, build the hierarchy
+    Class::ClassSet parents;
+    Class::BaseList bases;
+
+    // Iterate over the fields in the class
+    const DIArray arr = type.getTypeArray();
+    for (size_t a=0; a < arr.getNumElements(); ++a) {
+      const DIDescriptor elem = arr.getElement(a);
+      switch (elem.getTag()) {
+      case dwarf::DW_TAG_inheritance:
+        // This represents a parent type; get its Class and make it a parent of ours
+        DIDerivedType inh = DIDerivedType(elem);
+        Class* parent = getOrCreateHierarchy(DICompositeType(inh.getTypeDerivedFrom()));
+        parents.insert(parent);
+        Class::BaseSpecifier base = {parent, inh.getOffsetInBits(), inh.getFlags()};
+        bases.push_back(base);
+        break;
+      }
+    }
+
+    Class* const c = new Class(type.getName(), parents);
+    c->getBases() = bases;
+    /*ferrs() << "New class pointer for " << type.getName()
+            << " (" << ((MDNode*)type) << ") is " << c << '\n';*/
+    foreach (Class::ClassSet, parents, i) {
+      (*i)->getChildren().insert(c);
+    }
+
+    classes.insert(pair<MDNode*, Class*>((MDNode*)type, c));
+    return c;
+  }
+
+  /**
+   * Folds __dynamic_cast calls and type_info comparisons in f whose result is
+   * decided by the class hierarchy, either statically or by comparing the
+   * object's vtable pointer against a single vtable
+   */
+  bool FoldTypeQueries(Function& f) {
+    vector<Instruction*> Queries;
+    foreach (Function, f, bb) {
+      foreach (BasicBlock, *bb, i) {
+        if (CallInst* const Call = dyn_cast<CallInst>(&*i)) {
+          if (const Function* const Callee = Call->getCalledFunction()) {
+            const StringRef Name = Callee->getName();
+            if (Name == "__dynamic_cast" || Name == "_ZNKSt9type_infoeqERKS_"
+                || Name == "_ZNKSt9type_infoneERKS_") {
+              Queries.push_back(Call);
+            }
+          }
+        } else if (isa<ICmpInst>(&*i)) {
+          Queries.push_back(&*i);
+        }
+      }
+    }
+
+    bool changed = false;
+    foreach (vector<Instruction*>, Queries, Q) {
+      if (CallInst* const Call = dyn_cast<CallInst>(*Q)) {
+        if (Call->getCalledFunction()->getName() == "__dynamic_cast") {
+          changed |= FoldDynamicCast(Call);
+          continue;
+        }
+        const bool IsEqual =
+          Call->getCalledFunction()->getName() == "_ZNKSt9type_infoeqERKS_";
+        changed |= FoldTypeInfoCompare(Call, Call->getArgOperand(0),
+                                       Call->getArgOperand(1), IsEqual);
+      } else {
+        ICmpInst* const Cmp = cast<ICmpInst>(*Q);
+        if (Cmp->isEquality()) {
+          changed |= FoldTypeInfoCompare(Cmp, Cmp->getOperand(0),
+                                         Cmp->getOperand(1),
+                                         Cmp->getPredicate() == ICmpInst::ICMP_EQ);
+        }
+      }
+    }
+    return changed;
+  }
+
+  Class* GetClassForTypeInfo(const Value* const TypeInfo) const {
+    return TypeInfoToClass.lookup(TypeInfo->stripPointerCasts());
+  }
+
+  /**
+   * Whether every class derived from C is known, so that the hierarchy can
+   * answer questions about all the objects that are a C: when C and all its
+   * known descendants cannot be derived from outside the module. That is so
+   * for classes whose vtable or type_info has internal linkage (e.g. in an
+   * anonymous namespace), for classes in a sealed hierarchy, and, when the
+   * whole program is assumed to be in the module, for all classes except the
+   * extensible ones that are not hidden
+   */
+  bool IsClosed(Class* const C) {
+    DenseMap<Class*, bool>::iterator Cached = ClosedClasses.find(C);
+    if (Cached != ClosedClasses.end()) { return Cached->second; }
+    ClosedClasses[C] = false;
+
+    const GlobalValue* const Symbol =
+      C->getVTable() ? C->getVTable() : C->getTypeInfo();
+    bool Closed;
+    if (Symbol && Symbol->hasLocalLinkage()) {
+      Closed = true;
+    } else if (IsSealed(C)) {
+      Closed = true;
+    } else if (!WholeProgram) {
+      Closed = false;
+    } else if (Symbol && Symbol->hasHiddenVisibility()) {
+      Closed = true;
+    } else {
+      Closed = find(ExtensibleClasses.begin(), ExtensibleClasses.end(),
+                    C->getName().str()) == ExtensibleClasses.end()
+               && find(ExtensibleClasses.begin(), ExtensibleClasses.end(),
+                       C->getMangledName()) == ExtensibleClasses.end();
+    }
+    foreach (Class::ClassSet, C->getChildren(), Child) {
+      Closed = Closed && IsClosed(*Child);
+    }
+    ClosedClasses[C] = Closed;
+    return Closed;
+  }
+
+  /**
+   * Whether C derives from (or is) a class whose hierarchy is sealed, i.e.
+   * declared complete in the link unit
+   */
+  bool IsSealed(Class* const C) {
+    foreach (Class::ClassSet, SealedClasses, Root) {
+      if (C->isSubclassOf(*Root)) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * Whether the module defines every class derived from Root, as sealing its
+   * hierarchy declares. Reports the subclasses it does not define the vtable
+   * of, which come from outside the link unit
+   */
+  bool IsSealedHierarchyComplete(Class* const Root) {
+    Class::ClassSet Descendants;
+    Root->getDescendants(Descendants);
+    bool Complete = true;
+    foreach (Class::ClassSet, Descendants, D) {
+      if (*D == Root) { continue; }
+      const GlobalVariable* const VTable = (*D)->getVTable();
+      if (!VTable || VTable->isDeclaration()) {
+        ferrs() << "Sealed hierarchy of " << Root->getName()
+                << " has subclass " << (*D)->getName()
+                << " defined outside the module\n";
+        Complete = false;
+      }
+    }
+    return Complete;
+  }
+
+  /**
+   * Whether some class in the hierarchy is (or derives from) both A and B
+   */
+  bool HaveCommonSubclass(Class* const A, Class* const B) const {
+    Class::ClassSet Descendants;
+    A->getDescendants(Descendants);
+    foreach (Class::ClassSet, Descendants, D) {
+      if ((*D)->isSubclassOf(B)) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * Whether the vtable pointer of an object is exactly one of C's address
+   * points if and only if the object's dynamic type is C. This fails when C's
+   * vtable is not in the module, or during the construction of some class
+   * derived from C when construction vtables are used instead (so all of
+   * them must be known)
+   */
+  bool HasUniqueVTable(Class* const C) {
+    if (!C->getVTable() || C->getAddressPoints().empty() || !IsClosed(C)) {
+      return false;
+    }
+    Class::ClassSet Descendants;
+    C->getDescendants(Descendants);
+    foreach (Class::ClassSet, Descendants, D) {
+      if ((*D)->hasVirtualBases()) { return false; }
+    }
+    return true;
+  }
+
+  bool FoldDynamicCast(CallInst* const Call) {
+    Class* const Src = GetClassForTypeInfo(Call->getArgOperand(1));
+    Class* const Dst = GetClassForTypeInfo(Call->getArgOperand(2));
+    if (!Src || !Dst) { return false; }
+
+    // No object can be both a Src and a Dst: the cast always fails. A class
+    // deriving from both would derive from either, so one must be closed
+    if ((IsClosed(Src) || IsClosed(Dst)) && !HaveCommonSubclass(Src, Dst)) {
+      Call->replaceAllUsesWith(Constant::getNullValue(Call->getType()));
+      Call->eraseFromParent();
+      ferrs() << "Folded dynamic_cast to " << Dst->getName() << " into null\n";
+      return true;
+    }
+
+    // A leaf class is always the most derived class, so the cast succeeds
+    // exactly when the object's vtable pointer is one of the leaf's
+    if (!Dst->isLeaf() || !Dst->isPublicSubclassOf(Src)
+        || !HasUniqueVTable(Dst))
+      { return false; }
+    IRBuilder<> Builder(Call);
+    Value* const Object = Call->getArgOperand(0);
+    Value* const VPtr = Builder.CreateLoad(
+      Builder.CreateBitCast(Object,
+        PointerType::getUnqual(PointerType::getUnqual(Builder.getInt8PtrTy()))),
+      "vtable");
+    Value* Result = Constant::getNullValue(Call->getType());
+    const Class::AddressPointList& APs = Dst->getAddressPoints();
+    foreachI (Class::AddressPointList, APs, AP, const_iterator) {
+      Value* const IsDst = Builder.CreateICmpEQ(VPtr,
+        ConstantExpr::getBitCast(Dst->getAddressPointValue(*AP), VPtr->getType()));
+      Value* const Top = Builder.CreateConstInBoundsGEP1_64(Object, AP->OffsetToTop);
+      Result = Builder.CreateSelect(IsDst, Top, Result);
+    }
+    Call->replaceAllUsesWith(Result);
+    Call->eraseFromParent();
+    ferrs() << "Folded dynamic_cast to " << Dst->getName()
+            << " into a vtable comparison\n";
+    return true;
+  }
+
+  /**
+   * Matches the type_info pointer loaded from before an object's vtable
+   * address point, as emitted for typeid(*p). Returns the vtable pointer
+   * it is loaded through, or NULL
+   */
+  static Value* GetDynamicTypeInfoVPtr(Value* const TypeInfo) {
+    LoadInst* const Load = dyn_cast<LoadInst>(TypeInfo->stripPointerCasts());
+    if (!Load) { return NULL; }
+    GEPOperator* const GEP =
+      dyn_cast<GEPOperator>(Load->getPointerOperand()->stripPointerCasts());
+    if (!GEP || GEP->getNumIndices() != 1) { return NULL; }
+    const ConstantInt* const Index = dyn_cast<ConstantInt>(GEP->getOperand(1));
+    if (!Index || Index->getSExtValue() != -1) { return NULL; }
+    if (!isa<LoadInst>(GEP->getPointerOperand()->stripPointerCasts())) {
+      return NULL;
+    }
+    return GEP->getPointerOperand();
+  }
+
+  bool FoldTypeInfoCompare(Instruction* const Compare, Value* LHS, Value* RHS,
+                           const bool IsEqual) {
+    Value* VPtr = GetDynamicTypeInfoVPtr(LHS);
+    if (!VPtr) {
+      swap(LHS, RHS);
+      VPtr = GetDynamicTypeInfoVPtr(LHS);
+    }
+    if (!VPtr) { return false; }
+    Class* const C = GetClassForTypeInfo(RHS);
+    if (!C || !HasUniqueVTable(C)) { return false; }
+
+    // typeid(*p) == typeid(C) exactly when p's vtable pointer is one of C's
+    IRBuilder<> Builder(Compare);
+    Value* Result = NULL;
+    const Class::AddressPointList& APs = C->getAddressPoints();
+    foreachI (Class::AddressPointList, APs, AP, const_iterator) {
+      Value* const IsC = Builder.CreateICmpEQ(VPtr,
+        ConstantExpr::getBitCast(C->getAddressPointValue(*AP), VPtr->getType()));
+      Result = Result ? Builder.CreateOr(Result, IsC) : IsC;
+    }
+    if (!IsEqual) {
+      Result = Builder.CreateNot(Result);
+    }
+    if (Result->getType() != Compare->getType()) {
+      Result = Builder.CreateZExt(Result, Compare->getType());
+    }
+    Compare->replaceAllUsesWith(Result);
+    Compare->eraseFromParent();
+    ferrs() << "Folded typeid comparison with " << C->getName()
+            << " into a vtable comparison\n";
+    return true;
+  }
+
+  /**
+   * Returns the class an IR struct type was generated for, from its name
+   * ("class.Name" or "struct.Name", possibly suffixed to make it unique), or
+   * NULL if unknown or ambiguous. Identically laid out types are one and the
+   * same, so a type named after several classes (e.g. every class holding
+   * just a vtable pointer) cannot tell them apart
+   */
+  Class* GetClassForIRType(const Module& m, const Type* const Ty) {
+    if (TypeNameCounts.lookup(Ty) != 1) { return NULL; }
+    const string TypeName = m.getTypeName(Ty);
+    StringRef Name(TypeName);
+    if (!Name.startswith("class.") && !Name.startswith("struct.")) {
+      return NULL;
+    }
+    Name = Name.substr(Name.find('.') + 1);
+    while (!NameToClass.count(Name) && Name.rfind('.') != StringRef::npos) {
+      Name = Name.substr(0, Name.rfind('.'));
+    }
+    return NameToClass.lookup(Name);
+  }
+
+  /**
+   * Replaces loads of virtual base offsets from the vtable of an object (as
+   * emitted for conversions to a virtual base) by the offset itself, when
+   * the exact class of the object is known. Only the virtual base offset
+   * entries of the object's static class are read, and never in thunks:
+   * there this points to another subobject than its type says, and the
+   * entries loaded are vcall offsets of a secondary vtable
+   */
+  bool FoldVBaseOffsets(Function& f) {
+    if (f.isDeclaration() || IsThunk(f.getName())) { return false; }
+    DT = &getAnalysis<DominatorTree>(f);
+    vector<LoadInst*> Loads;
+    foreach (Function, f, bb) {
+      foreach (BasicBlock, *bb, i) {
+        LoadInst* const Load = dyn_cast<LoadInst>(&*i);
+        if (Load && !Load->isVolatile() && Load->getType()->isIntegerTy()) {
+          Loads.push_back(Load);
+        }
+      }
+    }
+
+    bool changed = false;
+    foreach (vector<LoadInst*>, Loads, Load) {
+      // load (bitcast (getelementptr i8* (load vptr), Offset))
+      GEPOperator* const GEP = dyn_cast<GEPOperator>(
+        (*Load)->getPointerOperand()->stripPointerCasts());
+      if (!GEP || GEP->getNumIndices() != 1) { continue; }
+      ConstantInt* const EntryOffset = dyn_cast<ConstantInt>(GEP->getOperand(1));
+      LoadInst* const VPtr = dyn_cast<LoadInst>(GEP->getPointerOperand());
+      if (!EntryOffset || !VPtr || EntryOffset->getSExtValue() >= 0
+          || GEP->getPointerOperand()->getType() != Type::getInt8PtrTy(f.getContext()))
+        { continue; }
+      // The vptr is loaded through a cast of the object pointer to i8**;
+      // stripping every cast could go back to the i8* result of new
+      Value* Object = VPtr->getPointerOperand();
+      Operator* const Cast = dyn_cast<Operator>(Object);
+      if (Cast && Cast->getOpcode() == Instruction::BitCast) {
+        Object = Cast->getOperand(0);
+      }
+      const PointerType* const ObjectTy = dyn_cast<PointerType>(Object->getType());
+      Class* const Static = ObjectTy
+        ? GetClassForIRType(*f.getParent(), ObjectTy->getElementType()) : NULL;
+      if (!Static || !IsVBaseOffsetEntry(Static, EntryOffset->getSExtValue())) {
+        continue;
+      }
+
+      const TypeFact Fact = GetTypeFact(Object, VPtr);
+      int64_t Offset;
+      if (!Fact.Exact || !Fact.C || !Fact.C->isSubclassOf(Static)
+          || !GetSubobjectVTableEntry(Fact.C, Static,
+                                      EntryOffset->getSExtValue(), Offset))
+        { continue; }
+      (*Load)->replaceAllUsesWith(ConstantInt::get((*Load)->getType(), Offset));
+      (*Load)->eraseFromParent();
+      changed = true;
+    }
+    return changed;
+  }
+
+  /**
+   * Whether the entry at ByteOffset from the address points of Static's
+   * vtables is one of its virtual base offsets: they follow the type_info
+   * and offset-to-top entries, one per virtual base, before any vcall offset
+   */
+  bool IsVBaseOffsetEntry(Class* const Static, const int64_t ByteOffset) {
+    Class::SubobjectList Subobjects;
+    if (!Static->getSubobjects(Subobjects)) { return false; }
+    int64_t VirtualBases = 0;
+    foreach (Class::SubobjectList, Subobjects, S) {
+      VirtualBases += S->Virtual;
+    }
+    const int64_t EntrySize = Static->getPointerSize();
+    return ByteOffset % EntrySize == 0 && ByteOffset <= -3 * EntrySize
+           && ByteOffset >= -(2 + VirtualBases) * EntrySize;
+  }
+
+  /**
+   * Reads the offset entry at ByteOffset from the address point that the
+   * vptr of the (unique) Static subobject of a complete C object points to
+   */
+  bool GetSubobjectVTableEntry(Class* const C, Class* const Static,
+                               const int64_t ByteOffset, int64_t& Entry) {
+    Class::SubobjectList Subobjects;
+    unsigned Index;
+    if (!C->getVTable() || !C->getSubobjects(Subobjects)
+        || !Class::findSubobject(Subobjects, Static, Index))
+      { return false; }
+    const Class::AddressPoint* const AP =
+      C->getAddressPointFor(Subobjects[Index].Offset);
+    return AP && C->getVTableOffsetEntry(*AP, ByteOffset, Entry);
+  }
+
+  /**
+   * Rewrites loops calling a virtual method on each element of an array of
+   * objects into two phases: the first sorts the element indices into one
+   * bucket per likely class (plus one for the others), comparing vtable
+   * pointers; the second runs one loop per bucket, where the call is direct.
+   */
+  bool PartitionLoopsByClass(Function& f) {
+    if (f.isDeclaration()) { return false; }
+    DT = &getAnalysis<DominatorTree>(f);
+    LoopInfo& LI = getAnalysis<LoopInfo>(f);
+
+    vector<LoopPartitioning> Plans;
+    for (LoopInfo::iterator L = LI.begin(); L != LI.end(); ++L) {
+      vector<Loop*> Worklist(1, *L);
+      while (!Worklist.empty()) {
+        Loop* const Next = Worklist.back();
+        Worklist.pop_back();
+        Worklist.insert(Worklist.end(), Next->begin(), Next->end());
+        LoopPartitioning Plan = {Next};
+        if (PlanLoopPartitioning(Plan)) {
+          Plans.push_back(Plan);
+        }
+      }
+    }
+
+    foreach (vector<LoopPartitioning>, Plans, Plan) {
+      PartitionLoop(*Plan);
+    }
+    return !Plans.empty();
+  }
+
+  bool PlanLoopPartitioning(LoopPartitioning& Plan) {
+    Loop* const L = Plan.L;
+    if (!L->empty() || L->getNumBlocks() != 1 || !L->getLoopPreheader()
+        || !L->getUniqueExitBlock() || !L->isLCSSAForm(*DT))
+      { return false; }
+    BasicBlock* const Body = L->getHeader();
+    Plan.Index = L->getCanonicalInductionVariable();
+    Plan.Count = L->getTripCount();
+    // The count is used before the loop, so it may not be computed in it
+    // (e.g. a bound reloaded on every iteration)
+    if (!Plan.Index || !Plan.Count || !L->isLoopInvariant(Plan.Count)) {
+      return false;
+    }
+
+    // The only virtual call, which must not write memory
+    Plan.Call = NULL;
+    foreach (BasicBlock, *Body, i) {
+      CallInst* const Call = dyn_cast<CallInst>(&*i);
+      if (!Call || GetDirectCallee(Call) || !GetVirtualCallee(Call))
+        { continue; }
+      if (Plan.Call) { return false; }
+      Plan.Call = Call;
+    }
+    if (!Plan.Call) { return false; }
+    FunctionMetadata* const MD = GetVirtualCallee(Plan.Call);
+    if (!MD->Virtuality || !classes.count(MD->ContainingType)
+        || GetSignatureEffect(MD) == MayWrite)
+      { return false; }
+    Plan.Static = classes.lookup(MD->ContainingType);
+
+    // The receiver is element Index of an array
+    LoadInst* const Element =
+      dyn_cast<LoadInst>(GetReceiver(Plan.Call)->stripPointerCasts());
+    if (!Element || Element->isVolatile()) { return false; }
+    GEPOperator* const GEP = dyn_cast<GEPOperator>(
+      Element->getPointerOperand()->stripPointerCasts());
+    if (!GEP || GEP->getNumIndices() != 1
+        || !L->isLoopInvariant(GEP->getPointerOperand()))
+      { return false; }
+    Value* ElementIndex = GEP->getOperand(1);
+    if (CastInst* const Cast = dyn_cast<CastInst>(ElementIndex)) {
+      ElementIndex = Cast->getOperand(0);
+    }
+    if (ElementIndex != Plan.Index) { return false; }
+
+    // The result is only combined into an accumulator
+    if (!Plan.Call->hasOneUse()) { return false; }
+    Instruction* User = cast<Instruction>(*Plan.Call->use_begin());
+    Plan.ResultCast = NULL;
+    if (isa<CastInst>(User)) {
+      if (!User->hasOneUse()) { return false; }
+      Plan.ResultCast = User;
+      User = cast<Instruction>(*User->use_begin());
+    }
+    Plan.Reduction = dyn_cast<BinaryOperator>(User);
+    if (!Plan.Reduction || !Plan.Reduction->getType()->isIntegerTy()) {
+      return false;
+    }
+    switch (Plan.Reduction->getOpcode()) {
+    case Instruction::Add: case Instruction::Mul: case Instruction::And:
+    case Instruction::Or: case Instruction::Xor:
+      break;
+    default:
+      return false;
+    }
+    const unsigned AccumulatorOp =
+      Plan.Reduction->getOperand(0) == (Plan.ResultCast ? Plan.ResultCast : Plan.Call);
+    Plan.Accumulator =
+      dyn_cast<PHINode>(Plan.Reduction->getOperand(AccumulatorOp));
+    if (!Plan.Accumulator || Plan.Accumulator->getParent() != Body
+        || !Plan.Accumulator->hasOneUse()
+        || Plan.Accumulator->getIncomingValueForBlock(Body) != Plan.Reduction)
+      { return false; }
+
+    // Nothing else in the loop may have an effect or be used after it,
+    // except the accumulated value
+    foreach (BasicBlock, *Body, i) {
+      Instruction* const I = &*i;
+      if (I == Plan.Call || I == Plan.ResultCast || I == Plan.Reduction
+          || I == Plan.Accumulator || I == Plan.Index
+          || I == Body->getTerminator())
+        { continue; }
+      if (I->mayWriteToMemory() || isa<PHINode>(I) || isa<CallInst>(I)
+          || (isa<LoadInst>(I) && cast<LoadInst>(I)->isVolatile()))
+        { return false; }
+      for (Value::use_iterator U = I->use_begin(); U != I->use_end(); ++U) {
+        if (!L->contains(cast<Instruction>(*U)->getParent())) { return false; }
+      }
+    }
+    BasicBlock* const Exit = L->getUniqueExitBlock();
+    for (BasicBlock::iterator i = Exit->begin(); isa<PHINode>(i); ++i) {
+      const Value* const Out = cast<PHINode>(i)->getIncomingValueForBlock(Body);
+      if (Out != Plan.Reduction) { return false; }
+    }
+    for (Value::use_iterator U = Plan.Index->use_begin();
+         U != Plan.Index->use_end(); ++U) {
+      if (!L->contains(cast<Instruction>(*U)->getParent())) { return false; }
+    }
+
+    // One bucket per likely class
+    Class::ClassSet Descendants;
+    Plan.Static->getDescendants(Descendants);
+    vector<pair<unsigned, Class*> > Weighted;
+    foreach (Class::ClassSet, Descendants, D) {
+      const TypeFact Fact = {*D, true};
+      int64_t Offset;
+      if (AllocationCounts.lookup(*D) && HasUniqueVTable(*D)
+          && ResolveByTypeFact(MD, Fact)
+          && (*D)->getBaseOffset(Plan.Static, Offset)
+          && (*D)->getAddressPointFor(Offset))
+        { Weighted.push_back(make_pair(AllocationCounts.lookup(*D), *D)); }
+    }
+    sort(Weighted.rbegin(), Weighted.rend());
+    for (size_t i = 0; i < Weighted.size() && i < MaxPartitions; ++i) {
+      Plan.Buckets.push_back(Weighted[i].second);
+    }
+    return !Plan.Buckets.empty();
+  }
+
+  /**
+   * Recreates the computation of V from the loop L at the builder's insertion
+   * point, using the values in VMap for those already recreated (such as the
+   * induction variable). Returns NULL if V depends on some other phi.
+   */
+  Value* Rematerialize(Value* const V, Loop* const L, ValueToValueMapTy& VMap,
+                       IRBuilder<>& Builder) {
+    if (Value* const Mapped = VMap.lookup(V)) { return Mapped; }
+    Instruction* const I = dyn_cast<Instruction>(V);
+    if (!I || !L->contains(I->getParent())) { return V; }
+    if (isa<PHINode>(I)) { return NULL; }
+    Instruction* const Clone = I->clone();
+    for (unsigned i = 0; i < I->getNumOperands(); ++i) {
+      Value* const Operand = Rematerialize(I->getOperand(i), L, VMap, Builder);
+      if (!Operand) {
+        delete Clone;
+        return NULL;
+      }
+      Clone->setOperand(i, Operand);
+    }
+    Builder.Insert(Clone, I->getName());
+    VMap[I] = Clone;
+    return Clone;
+  }
+
+  /**
+   * Starts a loop running Count times at the builder's insertion point,
+   * which is left at the start of the loop body. Returns the index.
+   */
+  PHINode* BeginCountedLoop(IRBuilder<>& Builder, Value* const Count,
+                            const Twine& Name, BasicBlock*& Body,
+                            BasicBlock*& Exit) {
+    Function* const F = Builder.GetInsertBlock()->getParent();
+    BasicBlock* const Entry = Builder.GetInsertBlock();
+    Body = BasicBlock::Create(F->getContext(), Name + ".body", F);
+    Exit = BasicBlock::Create(F->getContext(), Name + ".exit", F);
+    Builder.CreateCondBr(
+      Builder.CreateICmpEQ(Count, Constant::getNullValue(Count->getType())),
+      Exit, Body);
+    Builder.SetInsertPoint(Body);
+    PHINode* const Index = Builder.CreatePHI(Count->getType(), Name + ".index");
+    Index->reserveOperandSpace(2);
+    Index->addIncoming(Constant::getNullValue(Count->getType()), Entry);
+    return Index;
+  }
+
+  /**
+   * Ends a loop started by BeginCountedLoop, leaving the builder in its exit.
+   */
+  void EndCountedLoop(IRBuilder<>& Builder, PHINode* const Index,
+                      Value* const Count, BasicBlock* const Exit) {
+    Value* const Next = Builder.CreateAdd(Index,
+      ConstantInt::get(Index->getType(), 1), Index->getName() + ".next");
+    Index->addIncoming(Next, Builder.GetInsertBlock());
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Next, Count), Exit,
+                         Builder.GetInsertBlock());
+    Builder.SetInsertPoint(Exit);
+  }
+
+  /**
+   * Adds a value carried around the loop of Index, Initial on entry. Must
+   * be called before anything but phis is added to the loop body.
+   */
+  PHINode* AddLoopCarried(IRBuilder<>& Builder, PHINode* const Index,
+                          Value* const Initial, const Twine& Name) {
+    PHINode* const Phi = Builder.CreatePHI(Initial->getType(), Name);
+    Phi->reserveOperandSpace(2);
+    Phi->addIncoming(Initial, Index->getIncomingBlock(0));
+    return Phi;
+  }
+
+  /**
+   * Emits the bucket (0 to Buckets.size()) of the element of the loop's
+   * array at Index, by comparing its vtable pointer to the address points of
+   * the bucket classes; the last bucket holds the other classes
+   */
+  Value* EmitPartitionBucket(LoopPartitioning& Plan, Value* const Index,
+                             const Type* const IntPtrTy, IRBuilder<>& Builder) {
+    ValueToValueMapTy VMap;
+    VMap[Plan.Index] = Index;
+    Value* const Element =
+      Rematerialize(GetReceiver(Plan.Call), Plan.L, VMap, Builder);
+    Value* const VPtr = Builder.CreateLoad(
+      Builder.CreateBitCast(Element,
+        PointerType::getUnqual(PointerType::getUnqual(Builder.getInt8PtrTy()))),
+      "vtable");
+    Value* Bucket = ConstantInt::get(IntPtrTy, Plan.Buckets.size());
+    for (unsigned b = Plan.Buckets.size(); b-- > 0;) {
+      Class* const C = Plan.Buckets[b];
+      int64_t Offset;
+      C->getBaseOffset(Plan.Static, Offset);
+      Value* const IsC = Builder.CreateICmpEQ(VPtr, ConstantExpr::getBitCast(
+        C->getAddressPointValue(*C->getAddressPointFor(Offset)),
+        VPtr->getType()));
+      Bucket = Builder.CreateSelect(IsC, ConstantInt::get(IntPtrTy, b), Bucket);
+    }
+    return Bucket;
+  }
+
+  /**
+   * Replaces a loop by a counting sort of its element indices by bucket,
+   * into a buffer of Count indices, followed by one loop per bucket. The
+   * buffer is on the stack for short arrays, else on the heap; when it is
+   * too large or cannot be allocated, the original loop runs instead
+   */
+  void PartitionLoop(LoopPartitioning& Plan) {
+    Loop* const L = Plan.L;
+    BasicBlock* const Preheader = L->getLoopPreheader();
+    BasicBlock* const Body = L->getHeader();
+    BasicBlock* const Exit = L->getUniqueExitBlock();
+    Function* const F = Body->getParent();
+    Module* const M = F->getParent();
+    LLVMContext& Context = F->getContext();
+    const TargetData* const TD = getAnalysisIfAvailable<TargetData>();
+    const IntegerType* const IntPtrTy = TD ? TD->getIntPtrType(Context)
+                                           : Type::getInt64Ty(Context);
+    const Type* const IndexTy = Plan.Index->getType();
+    const uint64_t IndexSize = IndexTy->getPrimitiveSizeInBits() / 8;
+    const unsigned NumBuckets = Plan.Buckets.size() + 1;
+    FunctionMetadata* const MD = GetVirtualCallee(Plan.Call);
+    Value* const Initial =
+      Plan.Accumulator->getIncomingValueForBlock(Preheader);
+
+    BasicBlock* const Entry = BasicBlock::Create(Context, "partition", F, Body);
+    BasicBlock* const Fallback =
+      BasicBlock::Create(Context, "partition.fallback", F, Body);
+    BasicBlock* const Allocate =
+      BasicBlock::Create(Context, "partition.malloc", F, Body);
+    BasicBlock* const Ready =
+      BasicBlock::Create(Context, "partition.ready", F, Body);
+    Preheader->getTerminator()->setSuccessor(0, Entry);
+    BranchInst::Create(Body, Fallback);
+    for (BasicBlock::iterator i = Body->begin(); isa<PHINode>(i); ++i) {
+      PHINode* const Phi = cast<PHINode>(i);
+      Phi->setIncomingBlock(Phi->getBasicBlockIndex(Preheader), Fallback);
+    }
+
+    // A short array uses a buffer in the frame, allocated once; a longer one
+    // a heap buffer, unless its size in bytes would overflow
+    IRBuilder<> Builder(&F->getEntryBlock(), F->getEntryBlock().begin());
+    AllocaInst* const Stack = Builder.CreateAlloca(
+      ArrayType::get(IndexTy, PartitionStackSize), 0, "partition.stack");
+    Builder.SetInsertPoint(Entry);
+    Value* const Count = Builder.CreateIntCast(Plan.Count, IntPtrTy, false);
+    Value* const StackBuffer = Builder.CreateConstInBoundsGEP2_32(Stack, 0, 0);
+    BasicBlock* const Check =
+      BasicBlock::Create(Context, "partition.check", F, Allocate);
+    Builder.CreateCondBr(Builder.CreateICmpULE(Count,
+      ConstantInt::get(IntPtrTy, PartitionStackSize)), Ready, Check);
+    Builder.SetInsertPoint(Check);
+    const uint64_t MaxCount =
+      IntPtrTy->getMask().lshr(1).getZExtValue() / IndexSize;
+    Builder.CreateCondBr(
+      Builder.CreateICmpUGT(Count, ConstantInt::get(IntPtrTy, MaxCount)),
+      Fallback, Allocate);
+    Builder.SetInsertPoint(Allocate);
+    Constant* const Malloc = M->getOrInsertFunction("malloc",
+      Builder.getInt8PtrTy(), IntPtrTy, NULL);
+    Constant* const Free = M->getOrInsertFunction("free",
+      Type::getVoidTy(Context), Builder.getInt8PtrTy(), NULL);
+    Value* const Heap = Builder.CreateCall(Malloc,
+      Builder.CreateMul(Count, ConstantInt::get(IntPtrTy, IndexSize)),
+      "partition.heap");
+    Value* const HeapBuffer =
+      Builder.CreateBitCast(Heap, PointerType::getUnqual(IndexTy));
+    Builder.CreateCondBr(Builder.CreateIsNull(Heap), Fallback, Ready);
+    Builder.SetInsertPoint(Ready);
+    // free(NULL) does nothing, so the frame buffer needs no test
+    PHINode* const Freed = Builder.CreatePHI(Builder.getInt8PtrTy(),
+                                             "partition.heap");
+    Freed->reserveOperandSpace(2);
+    Freed->addIncoming(Constant::getNullValue(Builder.getInt8PtrTy()), Entry);
+    Freed->addIncoming(Heap, Allocate);
+    PHINode* const Buffer = Builder.CreatePHI(PointerType::getUnqual(IndexTy),
+                                              "partition.buffer");
+    Buffer->reserveOperandSpace(2);
+    Buffer->addIncoming(StackBuffer, Entry);
+    Buffer->addIncoming(HeapBuffer, Allocate);
+
+    // Phase 1: count the elements of each bucket
+    BasicBlock *CountBody, *CountExit;
+    PHINode* const CountIndex = BeginCountedLoop(Builder, Plan.Count,
+      "partition.count", CountBody, CountExit);
+    vector<PHINode*> Sizes;
+    for (unsigned b = 0; b < NumBuckets; ++b) {
+      Sizes.push_back(AddLoopCarried(Builder, CountIndex,
+        Constant::getNullValue(IntPtrTy), "partition.size"));
+    }
+    Value* Bucket = EmitPartitionBucket(Plan, CountIndex, IntPtrTy, Builder);
+    vector<Value*> NextSizes;
+    for (unsigned b = 0; b < NumBuckets; ++b) {
+      NextSizes.push_back(Builder.CreateAdd(Sizes[b], Builder.CreateZExt(
+        Builder.CreateICmpEQ(Bucket, ConstantInt::get(IntPtrTy, b)), IntPtrTy)));
+      Sizes[b]->addIncoming(NextSizes[b], CountBody);
+    }
+    EndCountedLoop(Builder, CountIndex, Plan.Count, CountExit);
+    vector<Value*> FinalSizes, Starts;
+    for (unsigned b = 0; b < NumBuckets; ++b) {
+      PHINode* const Final = Builder.CreatePHI(IntPtrTy, "partition.size");
+      Final->reserveOperandSpace(2);
+      Final->addIncoming(Constant::getNullValue(IntPtrTy), Ready);
+      Final->addIncoming(NextSizes[b], CountBody);
+      FinalSizes.push_back(Final);
+    }
+    Starts.push_back(Constant::getNullValue(IntPtrTy));
+    for (unsigned b = 1; b < NumBuckets; ++b) {
+      Starts.push_back(Builder.CreateAdd(Starts[b - 1], FinalSizes[b - 1]));
+    }
+
+    // Phase 2: store each index at the next free position of its bucket
+    BasicBlock *SortBody, *SortExit;
+    PHINode* const SortIndex = BeginCountedLoop(Builder, Plan.Count,
+      "partition.sort", SortBody, SortExit);
+    vector<PHINode*> Fills;
+    for (unsigned b = 0; b < NumBuckets; ++b) {
+      Fills.push_back(AddLoopCarried(Builder, SortIndex, Starts[b],
+                                     "partition.fill"));
+    }
+    Bucket = EmitPartitionBucket(Plan, SortIndex, IntPtrTy, Builder);
+    Value* Slot = Fills[NumBuckets - 1];
+    for (unsigned b = NumBuckets - 1; b-- > 0;) {
+      Slot = Builder.CreateSelect(
+        Builder.CreateICmpEQ(Bucket, ConstantInt::get(IntPtrTy, b)),
+        Fills[b], Slot);
+    }
+    Builder.CreateStore(SortIndex, Builder.CreateInBoundsGEP(Buffer, Slot));
+    for (unsigned b = 0; b < NumBuckets; ++b) {
+      Fills[b]->addIncoming(Builder.CreateAdd(Fills[b], Builder.CreateZExt(
+        Builder.CreateICmpEQ(Bucket, ConstantInt::get(IntPtrTy, b)), IntPtrTy)),
+        SortBody);
+    }
+    EndCountedLoop(Builder, SortIndex, Plan.Count, SortExit);
+
+    // Phase 3: one loop per bucket, where the call is direct except in the
+    // last one
+    Value* Accumulated = Initial;
+    for (unsigned b = 0; b < NumBuckets; ++b) {
+      BasicBlock* const BucketEntry = Builder.GetInsertBlock();
+      BasicBlock *BucketBody, *BucketExit;
+      PHINode* const Position = BeginCountedLoop(Builder, FinalSizes[b],
+        "partition.bucket", BucketBody, BucketExit);
+      PHINode* const Accumulator = AddLoopCarried(Builder, Position,
+        Accumulated, Plan.Accumulator->getName());
+      ValueToValueMapTy VMap;
+      VMap[Plan.Index] = Builder.CreateLoad(Builder.CreateInBoundsGEP(Buffer,
+        Builder.CreateAdd(Starts[b], Position)), "partition.element");
+      VMap[Plan.Accumulator] = Accumulator;
+      CallInst* const Call = cast<CallInst>(
+        Rematerialize(Plan.Call, L, VMap, Builder));
+      if (b + 1 < NumBuckets) {
+        const TypeFact Fact = {Plan.Buckets[b], true};
+        FunctionMetadata* const Target = ResolveByTypeFact(MD, Fact);
+        if (Target->Func) {
+          SetDirectCallee(Call, Target->Func);
+          SetCallMemoryEffect(Call, GetFunctionEffect(Target));
+        }
+      }
+      // The buckets reorder the reduction, whose partial results then differ
+      // from the original ones and may wrap where those did not
+      BinaryOperator* const Next = cast<BinaryOperator>(
+        Rematerialize(Plan.Reduction, L, VMap, Builder));
+      if (isa<OverflowingBinaryOperator>(Next)) {
+        Next->setHasNoSignedWrap(false);
+        Next->setHasNoUnsignedWrap(false);
+      }
+      Accumulator->addIncoming(Next, BucketBody);
+      EndCountedLoop(Builder, Position, FinalSizes[b], BucketExit);
+      PHINode* const Out = Builder.CreatePHI(Next->getType(),
+                                             Plan.Accumulator->getName());
+      Out->reserveOperandSpace(2);
+      Out->addIncoming(Accumulated, BucketEntry);
+      Out->addIncoming(Next, BucketBody);
+      Accumulated = Out;
+    }
+    Builder.CreateCall(Free, Freed);
+    Builder.CreateBr(Exit);
+
+    // The exit also receives the accumulated value from the new loops; the
+    // original loop only runs when no buffer could be had
+    for (BasicBlock::iterator i = Exit->begin(); isa<PHINode>(i); ++i) {
+      cast<PHINode>(i)->addIncoming(Accumulated, Builder.GetInsertBlock());
+    }
+    ferrs() << "Partitioned loop in " << F->getName() << " into "
+            << NumBuckets << " buckets by class\n";
+  }
+
+  /**
+   * Versions loops whose virtual calls have a loop-invariant receiver: one
+   * copy of the loop per likely class of the receiver, selected once by
+   * comparing its vtable pointer before the loop, where those calls are
+   * direct. The original loop is kept for the other classes.
+   */
+  bool VersionLoops(Function& f) {
+    if (f.isDeclaration()) { return false; }
+    DT = &getAnalysis<DominatorTree>(f);
+    LoopInfo& LI = getAnalysis<LoopInfo>(f);
+
+    // Plan everything before changing the CFG, which invalidates LoopInfo
+    vector<LoopVersioning> Plans;
+    foreach (LoopInfo, LI, TopLevel) {
+      LoopVersioning Plan = {NULL, NULL, NULL};
+      for (Loop::block_iterator bb = (*TopLevel)->block_begin(),
+           end = (*TopLevel)->block_end(); bb != end && !Plan.L; ++bb) {
+        foreach (BasicBlock, **bb, i) {
+          CallInst* const Call = dyn_cast<CallInst>(&*i);
+          if (Call && PlanLoopVersioning(Call, LI, Plan)) { break; }
+        }
+      }
+      if (Plan.L) {
+        Plans.push_back(Plan);
+      }
+    }
+
+    foreach (vector<LoopVersioning>, Plans, Plan) {
+      VersionLoop(*Plan);
+    }
+    return !Plans.empty();
+  }
+
+  /**
+   * Finds the outermost loop around a virtual call that can be versioned on
+   * the call's receiver, and the classes to version it for
+   */
+  bool PlanLoopVersioning(CallInst* const Call, LoopInfo& LI,
+                          LoopVersioning& Plan) {
+    FunctionMetadata* const MD = GetVirtualCallee(Call);
+    if (!MD || !MD->Virtuality || GetDirectCallee(Call)
+        || !classes.count(MD->ContainingType))
+      { return false; }
+    Value* const Receiver = GetReceiver(Call)->stripPointerCasts();
+
+    for (Loop* L = LI.getLoopFor(Call->getParent()); L; L = L->getParentLoop()) {
+      if (!CanVersionLoop(L, Receiver, Call->getParent())) { break; }
+      Plan.L = L;
+    }
+    if (!Plan.L) { return false; }
+    Plan.Receiver = Receiver;
+    Plan.Static = classes.lookup(MD->ContainingType);
+
+    // The likely classes: those with the most objects created, which have a
+    // vtable to compare against and for which the call becomes direct
+    Class::ClassSet Descendants;
+    Plan.Static->getDescendants(Descendants);
+    vector<pair<unsigned, Class*> > Weighted;
+    foreach (Class::ClassSet, Descendants, D) {
+      const TypeFact Fact = {*D, true};
+      int64_t Offset;
+      if (AllocationCounts.lookup(*D) && HasUniqueVTable(*D)
+          && ResolveByTypeFact(MD, Fact)
+          && (*D)->getBaseOffset(Plan.Static, Offset)
+          && (*D)->getAddressPointFor(Offset))
+        { Weighted.push_back(make_pair(AllocationCounts.lookup(*D), *D)); }
+    }
+    sort(Weighted.rbegin(), Weighted.rend());
+    for (size_t i = 0; i < Weighted.size() && i < MaxLoopVersions; ++i) {
+      Plan.Versions.push_back(Weighted[i].second);
+    }
+    if (Plan.Versions.empty()) {
+      Plan.L = NULL;
+      return false;
+    }
+
+    // Every virtual call on the same receiver benefits from the versioning
+    for (Loop::block_iterator bb = Plan.L->block_begin(),
+         end = Plan.L->block_end(); bb != end; ++bb) {
+      foreach (BasicBlock, **bb, i) {
+        CallInst* const Other = dyn_cast<CallInst>(&*i);
+        if (Other && GetVirtualCallee(Other)
+            && !GetDirectCallee(Other)
+            && GetReceiver(Other)->stripPointerCasts() == Receiver)
+          { Plan.Calls.push_back(Other); }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Whether the receiver's vtable pointer can be loaded once before L. The
+   * receiver must be invariant, dereferenced on every path through the first
+   * iteration (the call's block dominates the exits) and no constructor or
+   * destructor in the loop may change its vtable pointer
+   */
+  bool CanVersionLoop(Loop* const L, Value* const Receiver,
+                      BasicBlock* const CallBlock) {
+    if (!L->isLoopInvariant(Receiver) || !L->getLoopPreheader()
+        || !L->isLCSSAForm(*DT))
+      { return false; }
+    BlockVector Exiting;
+    L->getExitingBlocks(Exiting);
+    foreach (BlockVector, Exiting, E) {
+      if (!DT->dominates(CallBlock, *E)) { return false; }
+    }
+    unsigned Size = 0;
+    for (Loop::block_iterator bb = L->block_begin(), end = L->block_end();
+         bb != end; ++bb) {
+      Size += (*bb)->size();
+      foreach (BasicBlock, **bb, i) {
+        CallSite CS(&*i);
+        if (CS.getInstruction() && CS.getCalledFunction()
+            && IsConstructorOrDestructor(CS.getCalledFunction()->getName()))
+          { return false; }
+      }
+    }
+    return Size <= MaxVersionedLoopSize;
+  }
+
+  void VersionLoop(const LoopVersioning& Plan) {
+    Loop* const L = Plan.L;
+    BasicBlock* const Preheader = L->getLoopPreheader();
+    BasicBlock* const Header = L->getHeader();
+    Function* const F = Header->getParent();
+    LLVMContext& Context = F->getContext();
+    BlockVector ExitBlocks;
+    L->getUniqueExitBlocks(ExitBlocks);
+
+    // The original loop is entered through a new block, for null receivers
+    // and receivers of any other class
+    BasicBlock* const Generic =
+      BasicBlock::Create(Context, "version.generic", F, Header);
+    BranchInst::Create(Header, Generic);
+    for (BasicBlock::iterator i = Header->begin(); isa<PHINode>(i); ++i) {
+      PHINode* const Phi = cast<PHINode>(i);
+      Phi->setIncomingBlock(Phi->getBasicBlockIndex(Preheader), Generic);
+    }
+    BasicBlock* Dispatch =
+      BasicBlock::Create(Context, "version.dispatch", F, Generic);
+    Preheader->getTerminator()->eraseFromParent();
+    IRBuilder<> Builder(Preheader);
+    Builder.CreateCondBr(Builder.CreateIsNull(Plan.Receiver), Generic, Dispatch);
+    Builder.SetInsertPoint(Dispatch);
+    Value* const VPtr = Builder.CreateLoad(
+      Builder.CreateBitCast(Plan.Receiver,
+        PointerType::getUnqual(PointerType::getUnqual(Builder.getInt8PtrTy()))),
+      "vtable");
+
+    for (size_t v = 0; v < Plan.Versions.size(); ++v) {
+      Class* const C = Plan.Versions[v];
+
+      // Clone the loop body for this class
+      ValueToValueMapTy VMap;
+      vector<BasicBlock*> Clones;
+      for (Loop::block_iterator bb = L->block_begin(), end = L->block_end();
+           bb != end; ++bb) {
+        BasicBlock* const Clone =
+          CloneBasicBlock(*bb, VMap, ".v" + Twine(v), F, NULL);
+        VMap[*bb] = Clone;
+        Clones.push_back(Clone);
+      }
+      foreach (vector<BasicBlock*>, Clones, bb) {
+        foreach (BasicBlock, **bb, i) {
+          RemapInstruction(&*i, VMap, RF_IgnoreMissingEntries);
+        }
+      }
+
+      // Values leaving the loop (in LCSSA phis) may now come from the clone
+      foreach (BlockVector, ExitBlocks, Exit) {
+        for (BasicBlock::iterator i = (*Exit)->begin(); isa<PHINode>(i); ++i) {
+          PHINode* const Phi = cast<PHINode>(i);
+          for (unsigned p = 0, e = Phi->getNumIncomingValues(); p != e; ++p) {
+            if (!L->contains(Phi->getIncomingBlock(p))) { continue; }
+            Value* Incoming = VMap.lookup(Phi->getIncomingValue(p));
+            if (!Incoming) {
+              Incoming = Phi->getIncomingValue(p);
+            }
+            Phi->addIncoming(Incoming,
+                             cast<BasicBlock>(VMap.lookup(Phi->getIncomingBlock(p))));
+          }
+        }
+      }
+
+      // Enter the clone when the receiver has class C
+      BasicBlock* const ClonedHeader = cast<BasicBlock>(VMap.lookup(Header));
+      for (BasicBlock::iterator i = ClonedHeader->begin(); isa<PHINode>(i); ++i) {
+        PHINode* const Phi = cast<PHINode>(i);
+        Phi->setIncomingBlock(Phi->getBasicBlockIndex(Generic), Dispatch);
+      }
+      int64_t Offset;
+      C->getBaseOffset(Plan.Static, Offset);
+      Value* const IsC = Builder.CreateICmpEQ(VPtr, ConstantExpr::getBitCast(
+        C->getAddressPointValue(*C->getAddressPointFor(Offset)),
+        VPtr->getType()));
+      BasicBlock* const Next = v + 1 < Plan.Versions.size()
+        ? BasicBlock::Create(Context, "version.dispatch", F, Generic)
+        : Generic;
+      Builder.CreateCondBr(IsC, ClonedHeader, Next);
+      if (Next != Generic) {
+        Builder.SetInsertPoint(Next);
+        Dispatch = Next;
+      }
+
+      // The calls on the receiver are direct in the clone
+      foreachI (vector<CallInst*>, Plan.Calls, Call, const_iterator) {
+        const TypeFact Fact = {C, true};
+        FunctionMetadata* const Target =
+          ResolveByTypeFact(GetVirtualCallee(*Call), Fact);
+        if (Target && Target->Func) {
+          CallInst* const Clone = cast<CallInst>(VMap.lookup(*Call));
+          SetDirectCallee(Clone, Target->Func);
+          SetCallMemoryEffect(Clone, GetFunctionEffect(Target));
+        }
+      }
+    }
+    ferrs() << "Versioned loop in " << F->getName() << " on "
+            << Plan.Versions.size() << " receiver classes\n";
+  }
+
+  /**
+   * Replaces loads of the vtable pointer of an object, as tagged by the
+   * frontend, by a dominating load from the same pointer when nothing in
+   * between may change it. Only constructors and destructors change the
+   * vtable pointer of an object: one created in its storage afterwards is
+   * only reached through the same pointer if it is of the same class
+   */
+  bool ReuseVTablePointerLoads(Function& f) {
+    if (f.isDeclaration()) { return false; }
+    DT = &getAnalysis<DominatorTree>(f);
+    vector<LoadInst*> Loads;
+    foreach (Function, f, bb) {
+      foreach (BasicBlock, *bb, i) {
+        LoadInst* const Load = dyn_cast<LoadInst>(&*i);
+        if (Load && !Load->isVolatile() && Load->getMetadata("vtable-pointer")) {
+          Loads.push_back(Load);
+        }
+      }
+    }
+
+    // Replaced loads are only erased at the end, and dominance is strict, so
+    // a replacement may itself be replaced later. A load already replaced is
+    // never used as a replacement, since it is erased: its own replacement,
+    // which dominates it, is a candidate as well
+    vector<LoadInst*> Replaced;
+    SmallPtrSet<LoadInst*, 16> IsReplaced;
+    foreach (vector<LoadInst*>, Loads, Later) {
+      Value* const Object = (*Later)->getPointerOperand()->stripPointerCasts();
+      foreach (vector<LoadInst*>, Loads, Earlier) {
+        if (*Earlier == *Later || IsReplaced.count(*Earlier)
+            || (*Earlier)->getType() != (*Later)->getType()
+            || (*Earlier)->getPointerOperand()->stripPointerCasts() != Object
+            || !DT->dominates(*Earlier, *Later)
+            || MayChangeVTablePointer(*Earlier, *Later, GetUnderlyingObject(
+                 (*Earlier)->getPointerOperand())))
+          { continue; }
+        (*Later)->replaceAllUsesWith(*Earlier);
+        Replaced.push_back(*Later);
+        IsReplaced.insert(*Later);
+        break;
+      }
+    }
+    foreach (vector<LoadInst*>, Replaced, Load) {
+      (*Load)->eraseFromParent();
+    }
+    return !Replaced.empty();
+  }
+
+  /**
+   * Whether the vtable pointer of Object (an underlying object) may change
+   * between From and To, which From dominates: some path between them calls
+   * a constructor or destructor, runs inline assembly, or stores a pointer
+   * into (or copies memory to) the object or an object that cannot be told
+   * apart from it
+   */
+  bool MayChangeVTablePointer(Instruction* const From, Instruction* const To,
+                              const Value* const Object) {
+    SmallPtrSet<BasicBlock*, 16> Visited;
+    vector<BasicBlock*> Worklist(1, To->getParent());
+    while (!Worklist.empty()) {
+      BasicBlock* const BB = Worklist.back();
+      Worklist.pop_back();
+      // The walk starts before To, and stops after From
+      BasicBlock::iterator Begin = BB->begin();
+      BasicBlock::iterator End = BB->end();
+      if (BB == From->getParent()) { Begin = ++BasicBlock::iterator(From); }
+      if (BB == To->getParent() && Visited.empty()) { End = To; }
+      for (BasicBlock::iterator I = Begin; I != End; ++I) {
+        if (MayStoreVTablePointer(*I, Object)) { return true; }
+      }
+      if (BB == From->getParent()) { continue; }
+      for (pred_iterator P = pred_begin(BB), E = pred_end(BB); P != E; ++P) {
+        if (Visited.insert(*P)) { Worklist.push_back(*P); }
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Whether an instruction may store a vtable pointer into Object (the
+   * underlying object of a vtable pointer load)
+   */
+  static bool MayStoreVTablePointer(Instruction& I, const Value* const Object) {
+    const Value* Dest = NULL;
+    if (const StoreInst* const Store = dyn_cast<StoreInst>(&I)) {
+      if (!Store->getOperand(0)->getType()->isPointerTy()) { return false; }
+      Dest = Store->getPointerOperand();
+    } else if (const MemIntrinsic* const Mem = dyn_cast<MemIntrinsic>(&I)) {
+      Dest = Mem->getRawDest();
+    } else if (isa<CallInst>(I) || isa<InvokeInst>(I)) {
+      const CallSite CS(&I);
+      if (isa<InlineAsm>(CS.getCalledValue())) { return true; }
+      const Function* const Callee = CS.getCalledFunction();
+      return Callee && IsConstructorOrDestructor(Callee->getName());
+    } else {
+      return false;
+    }
+    const Value* const DestObject = GetUnderlyingObject(Dest);
+    return DestObject == Object || !isIdentifiedObject(DestObject)
+           || !isIdentifiedObject(Object);
+  }
+
+  bool runOnFunction(Function& f) {
+    if (f.isDeclaration()) { return false; }
+    DT = &getAnalysis<DominatorTree>(f);
+    bool changed = FoldMemberPointerCalls(f);
+    vector<CallInst*> Unresolved;
+    CallReceiverList Assumed;
+    foreach (Function, f, i) {
+      changed |= runOnBasicBlock(*i, Unresolved, Assumed);
+    }
+    if (CheckAssumedTypes) {
+      foreach (CallReceiverList, Assumed, Call) {
+        CheckAssumedType(Call->first, Call->second,
+                         GetAssertedClass(Call->first));
+      }
+      if (!Assumed.empty()) {
+        DT = &getAnalysis<DominatorTree>(f);
+      }
+    }
+    foreach (vector<CallInst*>, Unresolved, Call) {
+      if (SplitOnReceiver(*Call)) {
+        changed = true;
+        DT = &getAnalysis<DominatorTree>(f);
+      }
+    }
+    return changed;
+  }
+
+  /**
+   * Resolves the calls through pointers to member functions whose value is a
+   * known constant (&C::f), as annotated by the frontend
+   */
+  bool FoldMemberPointerCalls(Function& f) {
+    vector<CallInst*> Calls;
+    foreach (Function, f, bb) {
+      foreach (BasicBlock, *bb, i) {
+        CallInst* const Call = dyn_cast<CallInst>(&*i);
+        if (Call && Call->getMetadata("member-pointer-call")) {
+          Calls.push_back(Call);
+        }
+      }
+    }
+    bool changed = false;
+    foreach (vector<CallInst*>, Calls, Call) {
+      changed |= FoldMemberPointerCall(*Call);
+    }
+    return changed;
+  }
+
+  /**
+   * Resolves a call through a pointer to member function of constant value.
+   * The callee is a phi of the function the pointer holds and of the one
+   * loaded from the receiver's vtable, when the pointer is odd: then it is one
+   * plus the offset of a vtable slot, and the call is resolved like a virtual
+   * call to the method in that slot
+   */
+  bool FoldMemberPointerCall(CallInst* const Call) {
+    Value* const Callee = Call->getCalledValue()->stripPointerCasts();
+    if (isa<Function>(Callee)) { return false; }
+    IntToPtrInst* NonVirtual = dyn_cast<IntToPtrInst>(Callee);
+    if (PHINode* const Phi = dyn_cast<PHINode>(Callee)) {
+      for (unsigned i = 0; !NonVirtual && i < Phi->getNumIncomingValues(); ++i) {
+        NonVirtual = dyn_cast<IntToPtrInst>(
+          Phi->getIncomingValue(i)->stripPointerCasts());
+      }
+    }
+    Constant* const MemberPtr =
+      NonVirtual ? GetConstantValue(NonVirtual->getOperand(0)) : NULL;
+    if (!MemberPtr) { return false; }
+
+    if (ConstantExpr* const CE = dyn_cast<ConstantExpr>(MemberPtr)) {
+      Function* const F = CE->getOpcode() == Instruction::PtrToInt
+        ? dyn_cast<Function>(CE->getOperand(0)->stripPointerCasts()) : NULL;
+      if (!F) { return false; }
+      SetDirectCallee(Call, F);
+      ferrs() << "Resolved member pointer call:\n";
+      Call->dump();
+      return true;
+    }
+
+    // The slot is one of the vtable of the class of the member pointer, so
+    // the receiver must not have been adjusted to another base
+    const MDString* const TypeInfoName = dyn_cast_or_null<MDString>(
+      Call->getMetadata("member-pointer-call")->getOperand(0));
+    Class* const C = TypeInfoName && TypeInfoName->getString().startswith("_ZTI")
+      ? MangledToClass.lookup(TypeInfoName->getString().substr(4)) : NULL;
+    const ConstantInt* const Offset = dyn_cast<ConstantInt>(MemberPtr);
+    if (!C || !Offset || !(Offset->getZExtValue() & 1)) { return false; }
+    Value* Receiver = GetReceiver(Call)->stripPointerCasts();
+    if (GEPOperator* const Adjusted = dyn_cast<GEPOperator>(Receiver)) {
+      Constant* const Adjustment = Adjusted->getNumIndices() == 1
+        ? GetConstantValue(Adjusted->getOperand(1)) : NULL;
+      if (!Adjustment || !Adjustment->isNullValue()) { return false; }
+      Receiver = Adjusted->getPointerOperand();
+    }
+
+    FunctionMetadata* const MD =
+      GetVTableMethod(C, (Offset->getZExtValue() - 1) / C->getPointerSize());
+    if (!MD || !MD->Virtuality) { return false; }
+    FunctionMetadata* Target = NoOverriders(MD) ? MD : NULL;
+    ThunkAdjustment Adjustment = {0, 0};
+    if (!Target) {
+      Target = ResolveByTypeFact(MD, GetTypeFact(Receiver, Call), &Adjustment);
+    }
+    if (!Target) {
+      const TypeFact Static = {C, false};
+      Target = ResolveByTypeFact(MD, Static, &Adjustment);
+    }
+    if (!Target || !Target->Func) { return false; }
+    SetDirectTarget(Call, Target, Adjustment);
+    ferrs() << "Devirtualized member pointer call:\n";
+    Call->dump();
+    return true;
+  }
+
+  /**
+   * Returns the constant a value is known to hold, following extractvalues,
+   * phis, loads from constant globals and loads from allocas stored to once,
+   * before the load; or NULL if unknown
+   */
+  Constant* GetConstantValue(Value* const V, const unsigned Depth = 0) {
+    if (Constant* const C = dyn_cast<Constant>(V)) { return C; }
+    if (Depth > 6) { return NULL; }
+
+    if (ExtractValueInst* const Extract = dyn_cast<ExtractValueInst>(V)) {
+      Constant* const Aggregate =
+        GetConstantValue(Extract->getAggregateOperand(), Depth + 1);
+      return Aggregate ? ConstantExpr::getExtractValue(Aggregate,
+        Extract->idx_begin(), Extract->getNumIndices()) : NULL;
+    }
+
+    if (PHINode* const Phi = dyn_cast<PHINode>(V)) {
+      Constant* Common = NULL;
+      for (unsigned i = 0; i < Phi->getNumIncomingValues(); ++i) {
+        Constant* const C = GetConstantValue(Phi->getIncomingValue(i), Depth + 1);
+        if (!C || (Common && C != Common)) { return NULL; }
+        Common = C;
+      }
+      return Common;
+    }
+
+    LoadInst* const Load = dyn_cast<LoadInst>(V);
+    if (!Load || Load->isVolatile()) { return NULL; }
+    if (Constant* const Ptr = dyn_cast<Constant>(Load->getPointerOperand())) {
+      return ConstantFoldLoadFromConstPtr(Ptr,
+                                          getAnalysisIfAvailable<TargetData>());
+    }
+    AllocaInst* const Slot = dyn_cast<AllocaInst>(Load->getPointerOperand());
+    if (!Slot) { return NULL; }
+    StoreInst* Store = NULL;
+    for (Value::use_iterator U = Slot->use_begin(), E = Slot->use_end();
+         U != E; ++U) {
+      if (isa<LoadInst>(*U)) { continue; }
+      StoreInst* const S = dyn_cast<StoreInst>(*U);
+      if (!S || Store || S->getPointerOperand() != Slot) { return NULL; }
+      Store = S;
+    }
+    if (!Store || !DT->dominates(Store, Load)) { return NULL; }
+    return GetConstantValue(Store->getOperand(0), Depth + 1);
+  }
+
+  bool runOnBasicBlock(BasicBlock& bb, vector<CallInst*>& Unresolved,
+                       CallReceiverList& Assumed) {
+    bool changed = false;
+    foreach (BasicBlock, bb, i) {
+      if (CallInst* const Call = dyn_cast<CallInst>(&*i)) {
+        FunctionMetadata* const MD = GetVirtualCallee(Call);
+        if (!MD || !MD->Virtuality) {
+          continue;
+        }
+        FunctionMetadata* Target;
+        ThunkAdjustment Adjustment = {0, 0};
+        if (CanDevirt(MD, Call, IsCallOnThis(Call))) {
+          Target = MD;
+        } else {
+          Target = ResolveByTypeFact(MD, GetTypeFact(GetReceiver(Call), Call),
+                                     &Adjustment);
+        }
+        if (!Target && CheckAssumedTypes && GetAssertedClass(Call)) {
+          // The programmer asserts the receiver's class, which is checked
+          // before the call (GetTypeFact only trusts it unchecked)
+          const TypeFact Asserted = {GetAssertedClass(Call), true};
+          if (Asserted.C->getVTable()) {
+            Target = ResolveByTypeFact(MD, Asserted, &Adjustment);
+          }
+          if (Target && Target->Func) {
+            Assumed.push_back(make_pair(Call, GetReceiver(Call)));
+          }
+        }
+        if (!Target) {
+          // Only the subclasses of the receiver's static class can override
+          const TypeFact Static = {GetStaticClass(Call), false};
+          Target = ResolveByTypeFact(MD, Static, &Adjustment);
+        }
+        MemoryEffect Effect;
+        if (Target && Target->Func) {
+          SetDirectTarget(Call, Target, Adjustment);
+          ferrs() << "Devirtualized:\n";
+          Call->dump();
+          changed = true;
+          Effect = GetFunctionEffect(Target);
+        } else {
+          Effect = GetSignatureEffect(MD);
+          Unresolved.push_back(Call);
+        }
+        changed |= SetCallMemoryEffect(Call, Effect);
+      }
+    }
+    return changed;
+  }
+
+  /**
+   * Splits a virtual call whose receiver is a phi or select of objects of
+   * known classes, e.g. (cond ? new A : new B)->f(), into one direct call per
+   * target, chosen by the select condition or by the edge the phi was
+   * reached through
+   */
+  bool SplitOnReceiver(CallInst* const Call) {
+    FunctionMetadata* const MD = GetVirtualCallee(Call);
+    Value* const Receiver = GetReceiver(Call)->stripPointerCasts();
+    BasicBlock* const BB = Call->getParent();
+
+    // The target for each incoming value, NULL for null pointers (calling
+    // through them is undefined, so any target will do)
+    vector<Value*> Incoming;
+    vector<Instruction*> IncomingAt;
+    SelectInst* const Select = dyn_cast<SelectInst>(Receiver);
+    PHINode* const Phi = dyn_cast<PHINode>(Receiver);
+    if (Select) {
+      Incoming.push_back(Select->getTrueValue());
+      Incoming.push_back(Select->getFalseValue());
+      IncomingAt.assign(2, Select);
+    } else if (Phi && Phi->getParent() == BB) {
+      for (unsigned i = 0; i < Phi->getNumIncomingValues(); ++i) {
+        Incoming.push_back(Phi->getIncomingValue(i));
+        IncomingAt.push_back(Phi->getIncomingBlock(i)->getTerminator());
+      }
+    } else {
+      return false;
+    }
+    vector<FunctionMetadata*> Targets;
+    vector<ThunkAdjustment> Adjustments;
+    vector<unsigned> Cases;
+    for (size_t i = 0; i < Incoming.size(); ++i) {
+      if (isa<ConstantPointerNull>(Incoming[i]->stripPointerCasts())) {
+        Cases.push_back(0);
+        continue;
+      }
+      ThunkAdjustment Adjustment = {0, 0};
+      FunctionMetadata* const Target = ResolveByTypeFact(MD,
+        GetTypeFact(Incoming[i], IncomingAt[i]), &Adjustment);
+      if (!Target || !Target->Func) { return false; }
+      size_t Case = 0;
+      while (Case < Targets.size()
+             && (Targets[Case]->Func != Target->Func
+                 || Adjustments[Case].This != Adjustment.This
+                 || Adjustments[Case].Return != Adjustment.Return))
+        { ++Case; }
+      if (Case == Targets.size()) {
+        Targets.push_back(Target);
+        Adjustments.push_back(Adjustment);
+      }
+      Cases.push_back(Case);
+    }
+    if (Targets.empty()) { return false; }
+
+    if (Targets.size() == 1) {
+      SetDirectTarget(Call, Targets[0], Adjustments[0]);
+      SetCallMemoryEffect(Call, GetFunctionEffect(Targets[0]));
+      ferrs() << "Devirtualized:\n";
+      Call->dump();
+      return true;
+    }
+
+    // Number the phi's incoming edges by target before splitting the block
+    LLVMContext& Context = BB->getContext();
+    const IntegerType* const CaseTy = Type::getInt32Ty(Context);
+    PHINode* Selector = NULL;
+    if (Phi) {
+      Selector = PHINode::Create(CaseTy, "devirt.selector", &BB->front());
+      Selector->reserveOperandSpace(Cases.size());
+      for (size_t i = 0; i < Cases.size(); ++i) {
+        Selector->addIncoming(ConstantInt::get(CaseTy, Cases[i]),
+                              Phi->getIncomingBlock(i));
+      }
+    }
+
+    BasicBlock* const Join = BB->splitBasicBlock(Call, "devirt.join");
+    BB->getTerminator()->eraseFromParent();
+    PHINode* Result = NULL;
+    if (!Call->getType()->isVoidTy()) {
+      Result = PHINode::Create(Call->getType(), Call->getName(), Call);
+      Result->reserveOperandSpace(Targets.size());
+    }
+    const unsigned ReceiverArg = GetReceiver(Call) == Call->getArgOperand(0) ? 0 : 1;
+    vector<BasicBlock*> CaseBlocks;
+    for (size_t Case = 0; Case < Targets.size(); ++Case) {
+      BasicBlock* const CaseBlock = BasicBlock::Create(Context, "devirt.case",
+                                                       BB->getParent(), Join);
+      CallInst* const Direct = cast<CallInst>(Call->clone());
+      CaseBlock->getInstList().push_back(Direct);
+      BranchInst::Create(Join, CaseBlock);
+      if (Select) {
+        // Each arm dominates the select, so the call can use it directly
+        Value* Arm = Incoming[find(Cases.begin(), Cases.end(), Case) - Cases.begin()];
+        if (Arm->getType() != Direct->getArgOperand(ReceiverArg)->getType()) {
+          Arm = new BitCastInst(Arm, Direct->getArgOperand(ReceiverArg)->getType(),
+                                "", Direct);
+        }
+        Direct->setArgOperand(ReceiverArg, Arm);
+      }
+      Value* const Returned =
+        SetDirectTarget(Direct, Targets[Case], Adjustments[Case]);
+      SetCallMemoryEffect(Direct, GetFunctionEffect(Targets[Case]));
+      if (Result) { Result->addIncoming(Returned, CaseBlock); }
+      ferrs() << "Devirtualized:\n";
+      Direct->dump();
+      CaseBlocks.push_back(CaseBlock);
+    }
+
+    if (Select) {
+      BranchInst::Create(CaseBlocks[0], CaseBlocks[1], Select->getCondition(), BB);
+    } else {
+      SwitchInst* const Switch = SwitchInst::Create(Selector, CaseBlocks.back(),
+                                                    CaseBlocks.size() - 1, BB);
+      for (size_t Case = 0; Case + 1 < CaseBlocks.size(); ++Case) {
+        Switch->addCase(ConstantInt::get(CaseTy, Case), CaseBlocks[Case]);
+      }
+    }
+    if (Result) { Call->replaceAllUsesWith(Result); }
+    Call->eraseFromParent();
+    return true;
+  }
+
+  /**
+   * Returns the class of which F is the complete object constructor, or NULL
+   */
+  Class* GetConstructorClass(const Function* const F) {
+    string ClassName, Signature;
+    if (!F || !SplitMangledMethodName(F->getName(), ClassName, Signature)
+        || !StringRef(Signature).startswith("C1"))
+      { return NULL; }
+    return MangledToClass.lookup(ClassName);
+  }
+
+  /**
+   * Returns the class whose constructor or destructor Object is the this
+   * argument of, or NULL, if the object is known to be of that class at At.
+   * It is from the store of the class' vtable into the vptr until the next
+   * call, which may construct or destroy the object again (a base
+   * constructor or destructor inlined into the body stores its own vtable).
+   * The store must reach At through single predecessors. The base object
+   * variants (C2, D2) run on a subobject laid out without its virtual bases,
+   * so only count for classes that have none
+   */
+  Class* GetRunningStructorClass(Value* const Object, Instruction* const At) {
+    const Argument* const This = dyn_cast<Argument>(Object);
+    if (!This || This->getArgNo() != 0
+        || !IsConstructorOrDestructor(This->getParent()->getName()))
+      { return NULL; }
+    string ClassName, Signature;
+    SplitMangledMethodName(This->getParent()->getName(), ClassName, Signature);
+    Class* const C = MangledToClass.lookup(ClassName);
+    if (!C || C->getAddressPoints().empty()
+        || (Signature[1] == '2' && C->hasVirtualBases()))
+      { return NULL; }
+
+    SmallPtrSet<BasicBlock*, 8> Visited;
+    BasicBlock* BB = At->getParent();
+    BasicBlock::iterator I = At;
+    while (Visited.insert(BB)) {
+      while (I != BB->begin()) {
+        --I;
+        if (StoreInst* const Store = dyn_cast<StoreInst>(I)) {
+          if (Store->getPointerOperand()->stripPointerCasts() != This) {
+            continue;
+          }
+          return IsPrimaryVTableAddress(Store->getValueOperand(), C)
+                 ? C : NULL;
+        }
+        if (isa<DbgInfoIntrinsic>(I)) { continue; }
+        if (isa<CallInst>(I) || isa<InvokeInst>(I)) { return NULL; }
+      }
+      BB = BB->getSinglePredecessor();
+      if (!BB) { return NULL; }
+      I = BB->end();
+    }
+    return NULL;
+  }
+
+  /**
+   * Whether V is the address point of the primary vtable of C
+   */
+  bool IsPrimaryVTableAddress(Value* const V, const Class* const C) {
+    const GEPOperator* const GEP =
+      dyn_cast<GEPOperator>(V->stripPointerCasts());
+    if (!GEP || GEP->getPointerOperand() != C->getVTable()
+        || GEP->getNumIndices() != 2)
+      { return false; }
+    const ConstantInt* const Index = dyn_cast<ConstantInt>(GEP->getOperand(2));
+    return Index && Index->getZExtValue() == C->getAddressPoints().front().Index;
+  }
+
+  /**
+   * Returns the class whose complete object constructor is run on a new or
+   * local object before At, or NULL. This is its exact class from then on.
+   */
+  Class* GetConstructedClass(Value* const Object, Instruction* const At) {
+    if (!isa<AllocaInst>(Object)) {
+      CallSite CS(Object);
+      const Function* const Callee =
+        CS.getInstruction() ? CS.getCalledFunction() : NULL;
+      if (!Callee || (Callee->getName() != "_Znwm"
+                      && Callee->getName() != "_Znwj"))
+        { return NULL; }
+    }
+    Class* Constructed = NULL;
+    SmallVector<Value*, 4> Worklist(1, Object);
+    while (!Worklist.empty()) {
+      Value* const V = Worklist.pop_back_val();
+      for (Value::use_iterator U = V->use_begin(); U != V->use_end(); ++U) {
+        if (isa<BitCastInst>(*U)) {
+          Worklist.push_back(*U);
+          continue;
+        }
+        Instruction* const I = dyn_cast<Instruction>(*U);
+        if (!I) { continue; }
+        CallSite CS(I);
+        if (!CS.getInstruction() || CS.arg_empty() || CS.getArgument(0) != V) {
+          continue;
+        }
+        Class* const C = GetConstructorClass(CS.getCalledFunction());
+        if (!C) { continue; }
+        if ((Constructed && Constructed != C) || !DT->dominates(I, At)) {
+          return NULL;
+        }
+        Constructed = C;
+      }
+    }
+    return Constructed;
+  }
+
+  /**
+   * Makes a virtual call direct to Target, applying the adjustments of the
+   * thunk it would have gone through at the call site. Returns the value
+   * that replaces the call's result
+   */
+  Value* SetDirectTarget(CallInst* const Call, FunctionMetadata* const Target,
+                         const ThunkAdjustment& Adjustment) {
+    SetDirectCallee(Call, Target->Func);
+    if (Adjustment.This) {
+      const unsigned ReceiverArg =
+        GetReceiver(Call) == Call->getArgOperand(0) ? 0 : 1;
+      Call->setArgOperand(ReceiverArg,
+        AdjustPointer(Call->getArgOperand(ReceiverArg), Adjustment.This, Call));
+    }
+    if (!Adjustment.Return) { return Call; }
+
+    // Null is returned unadjusted
+    vector<User*> Users(Call->use_begin(), Call->use_end());
+    Instruction* const Next = ++BasicBlock::iterator(Call);
+    Value* const Adjusted = AdjustPointer(Call, Adjustment.Return, Next);
+    Value* const IsNull = new ICmpInst(Next, ICmpInst::ICMP_EQ, Call,
+      Constant::getNullValue(Call->getType()));
+    Value* const Result = SelectInst::Create(IsNull, Call, Adjusted, "", Next);
+    foreach (vector<User*>, Users, U) {
+      (*U)->replaceUsesOfWith(Call, Result);
+    }
+    return Result;
+  }
+
+  /**
+   * Returns the class a method returns a pointer or reference to, or NULL
+   */
+  Class* GetReturnedClass(FunctionMetadata* const MD) {
+    DIArray Types = DICompositeType(MD->Type).getTypeArray();
+    if (Types.getNumElements() == 0) { return NULL; }
+    DIType T(Types.getElement(0));
+    bool Indirect = false;
+    while (T.isDerivedType()) {
+      switch (T.getTag()) {
+      case dwarf::DW_TAG_pointer_type:
+      case dwarf::DW_TAG_reference_type:
+        if (Indirect) { return NULL; }
+        Indirect = true;
+        break;
+      case dwarf::DW_TAG_const_type:
+      case dwarf::DW_TAG_volatile_type:
+      case dwarf::DW_TAG_typedef:
+        break;
+      default:
+        return NULL;
+      }
+      T = DIDerivedType(T).getTypeDerivedFrom();
+    }
+    return Indirect && classes.count(T) ? classes.lookup(T) : NULL;
+  }
+
+  /**
+   * Returns the method a virtual call to MD dispatches to when the receiver's
+   * dynamic type satisfies Fact, or NULL if that is not a single method.
+   * When the dispatch goes through a thunk, fails unless Adjustment is given
+   * to receive the adjustments the caller must make instead.
+   */
+  FunctionMetadata* ResolveByTypeFact(FunctionMetadata* const MD,
+                                      const TypeFact& Fact,
+                                      ThunkAdjustment* const Adjustment = NULL) {
+    if (!Fact.C || !classes.count(MD->ContainingType)) { return NULL; }
+    Class* const Static = classes.lookup(MD->ContainingType);
+    if (!Fact.C->isSubclassOf(Static)) { return NULL; }
+
+    // The final overrider for the Static subobject the call goes through.
+    // Virtual bases are only laid out in a complete object, so Fact.C must be
+    // exact if it has any
+    Class::SubobjectList Subobjects;
+    unsigned Via, Overrider;
+    if ((!Fact.Exact && Fact.C->hasVirtualBases())
+        || !Fact.C->getSubobjects(Subobjects)
+        || !Class::findSubobject(Subobjects, Static, Via))
+      { return NULL; }
+    FunctionMetadata* const Target =
+      Fact.C->getFinalOverrider(Subobjects, Via, MD->Name, MD->Type, Overrider);
+    if (!Target || Target->Virtuality == dwarf::DW_VIRTUALITY_pure_virtual
+        || !classes.count(Target->ContainingType))
+      { return NULL; }
+
+    if (!Fact.Exact) {
+      // A class derived from Fact.C may override the method again
+      if (!IsClosed(Fact.C) || !OverriddenByMap.count(MD)) { return NULL; }
+      const MDSet& OverriddenBy = OverriddenByMap.lookup(MD);
+      foreachI (MDSet, OverriddenBy, Overrider, const_iterator) {
+        Class* const OverriderClass =
+          classes.lookup((*Overrider)->ContainingType);
+        if (*Overrider != Target && OverriderClass->isSubclassOf(Fact.C)) {
+          return NULL;
+        }
+      }
+    }
+
+    // The call passes a pointer to the Static subobject, while the target
+    // expects one to the subobject it overrides the method in
+    const int64_t StaticOffset = Subobjects[Via].Offset;
+    const int64_t TargetOffset = Subobjects[Overrider].Offset;
+
+    // A covariant override returns a pointer to a derived class, which the
+    // caller expects converted to the class MD returns. Without debug info
+    // the return types are unknown, so overrides returning pointers are not
+    // resolved
+    if (!MD->Type.isCompositeType() && Target != MD && Target->Func
+        && Target->Func->getReturnType()->isPointerTy())
+      { return NULL; }
+    int64_t ReturnOffset = 0;
+    Class* const StaticReturn = GetReturnedClass(MD);
+    Class* const TargetReturn = GetReturnedClass(Target);
+    if (StaticReturn && TargetReturn && StaticReturn != TargetReturn
+        && !TargetReturn->getBaseOffset(StaticReturn, ReturnOffset))
+      { return NULL; }
+
+    const ThunkAdjustment Needed = {TargetOffset - StaticOffset, ReturnOffset};
+    if (Adjustment) {
+      *Adjustment = Needed;
+    } else if (Needed.This || Needed.Return) {
+      return NULL;
     }
+    return Target;
   }
 
-  virtual bool runOnModule(Module& m) {
-    const NamedMDNode* const sp = m.getNamedMetadata(Twine("llvm.dbg.sp"));
-    if (!sp) {
-      ferrs() << "No llvm.dbg.sp metadata found\n";
-      return false;
-    }
+  /**
+   * Finds what is known about the dynamic type of Object at instruction At:
+   * the constructor that created it, a dynamic_cast it is the result of, a
+   * dominating check of its vtable pointer or type_info, or the same for the
+   * complete object when Object is one of its base subobjects
+   */
+  TypeFact GetTypeFact(Value* const Object, Instruction* const At,
+                       const unsigned Depth = 0) {
+    const TypeFact None = {NULL, false};
+    if (Depth > 4) { return None; }
+    Value* const V = Object->stripPointerCasts();
 
-    // Build the map from linkage name's to metadata
-    for (size_t i=0; i < sp->getNumOperands(); ++i) {
-      const MDNode* const MD = sp->getOperand(i);
-      UpdateLinkageToMetadata(DISubprogram(MD));
+    if (Class* const C = GetConstructedClass(V, At)) {
+      const TypeFact Constructed = {C, true};
+      return Constructed;
     }
 
-    // Get Functions from the module if the Function's not defined in the Module
-    foreach(StringMap<FunctionMetadata*>, LinkageToMetadata, i) {
-    	FunctionMetadata* const f = i->second;
-    	if (!f->Func) {
-    		f->Func = m.getFunction(f->LinkageName);
-    	}
+    if (Class* const C = GetRunningStructorClass(V, At)) {
+      const TypeFact Running = {C, true};
+      return Running;
     }
 
-    // Build class hierarchy
-    for (size_t i=0; i < sp->getNumOperands(); ++i) {
-      const MDNode* const MD = sp->getOperand(i);
-      const DISubprogram Subprogram = DISubprogram(MD);
-      const DICompositeType type = Subprogram.getContainingType();
-      if (type.Verify() && type.getTag() == dwarf::DW_TAG_class_type) {
-        getOrCreateHierarchy(type);
+    if (CallInst* const Call = dyn_cast<CallInst>(V)) {
+      const Function* const Callee = Call->getCalledFunction();
+      if (Callee && Callee->getName() == "__dynamic_cast") {
+        const TypeFact Cast = {GetClassForTypeInfo(Call->getArgOperand(2)), false};
+        return Cast;
       }
     }
 
-    // Associate functions with their defining classes
-    foreachI(StringMap<FunctionMetadata*>, LinkageToMetadata, i, const_iterator) {
-    	FunctionMetadata* const f = i->second;
-    	const TypeMap::iterator c = classes.find(f->ContainingType);
-    	/*ferrs() << "Found function " << f->Name << " (" << f->LinkageName
-				   << ") ";*/
-    	if (c != classes.end()) {
-    		Class* const C = c->second;
-    		/*ferrs() << "in class " << C->getName() << '\n';*/
-        C->getMethods().insert(f);
-    	} /*else {
-    		ferrs() << "WITH NO CLASS\n";
-    	}*/
+    // A dynamic_cast folded into a vtable comparison
+    if (SelectInst* const Select = dyn_cast<SelectInst>(V)) {
+      Value* Checked;
+      TypeFact Fact;
+      bool OnTrue;
+      if (isa<ConstantPointerNull>(Select->getFalseValue())
+          && MatchTypeCheck(Select->getCondition(), Checked, Fact, OnTrue)
+          && OnTrue && Checked == Select->getTrueValue()->stripPointerCasts())
+        { return Fact; }
     }
 
-    /*for (TypeMap::const_iterator i = classes.begin(); i != classes.end(); ++i) {
-      ferrs() << "Found class (" << i->second << ") with hierarchy:\n";
-      (*i).second->dump();
-    }*/
-
-    // Group functions by their signature
-    // (i.e. function signature equivalence sets)
-    foreach (StringMap<FunctionMetadata*>, LinkageToMetadata, MDIter) {
-      FunctionMetadata* MD = MDIter->second;
-      if (MDSet* v = GetOrCreateEquSet(MD)) {
-        v->insert(MD);
+    // Every non-null incoming value must agree (calling through null is
+    // undefined)
+    if (PHINode* const Phi = dyn_cast<PHINode>(V)) {
+      TypeFact Merged = None;
+      for (unsigned i = 0; i < Phi->getNumIncomingValues(); ++i) {
+        Value* const Incoming = Phi->getIncomingValue(i);
+        if (isa<ConstantPointerNull>(Incoming->stripPointerCasts())) { continue; }
+        const TypeFact Fact = GetTypeFact(Incoming,
+          Phi->getIncomingBlock(i)->getTerminator(), Depth + 1);
+        if (!Fact.C || (Merged.C && (Merged.C != Fact.C
+                                     || Merged.Exact != Fact.Exact))) {
+          Merged = None;
+          break;
+        }
+        Merged = Fact;
       }
+      if (Merged.C) { return Merged; }
     }
 
-    // Use class hierarchy and equivalence sets to identify overriden methods
-    foreach (StringMap<FunctionMetadata*>, LinkageToMetadata, MDIter) {
-      FunctionMetadata* MD = MDIter->second;
-      SetOverridenByFor(MD);
-    }
-
-    // Build call graph
-    foreach (Module, m, f) {
-      foreach (Function, *f, bb) {
-        foreach (BasicBlock, *bb, i) {
-          if (CallInst* const Call = dyn_cast<CallInst>(&*i)) {
-            UpdateCallGraph(Call, f);
+    // A base subobject of an object of exact class, as the frontend converts
+    // to it: an i8* offset, constant or loaded from the vtable for a virtual
+    // base. Its final overriders are those of the complete object (the
+    // caller rejects a base class with more than one subobject)
+    if (GEPOperator* const GEP = dyn_cast<GEPOperator>(V)) {
+      Value* const Offset = GEP->getNumIndices() == 1 ? GEP->getOperand(1) : NULL;
+      if (Offset && GEP->getPointerOperand()->getType()
+                      == Type::getInt8PtrTy(V->getContext())
+          && (isa<ConstantInt>(Offset) || isa<LoadInst>(Offset))) {
+        const TypeFact Complete =
+          GetTypeFact(GEP->getPointerOperand(), At, Depth + 1);
+        Class::SubobjectList Subobjects;
+        if (Complete.Exact && Complete.C
+            && Complete.C->getSubobjects(Subobjects)) {
+          ConstantInt* const Constant = dyn_cast<ConstantInt>(Offset);
+          foreach (Class::SubobjectList, Subobjects, S) {
+            if (!Constant || S->Offset == Constant->getSExtValue()) {
+              return Complete;
+            }
           }
         }
       }
     }
-    /*#define XX DenseMap<FunctionMetadata*, vector<CallEdge> >
-    foreach (XX, CallGraph, X) {
-      FunctionMetadata* From = X->first;
-      ferrs() << From->LinkageName << "->\n";
-      foreach (vector<CallEdge>, X->second, Edge) {
-        ferrs() << "  " << (Edge->ToFunc?Edge->ToFunc->LinkageName:"?") << "\n";
-      }
-    }*/
 
-    // Run the devirtualization
-    bool changed = false;
-    foreach (Module, m, i) {
-      changed |= runOnFunction(*i);
+    // A type check dominating At. A block with a single predecessor is only
+    // reached through that predecessor's branch
+    for (DomTreeNode* N = DT->getNode(At->getParent()); N; N = N->getIDom()) {
+      BasicBlock* const BB = N->getBlock();
+      BasicBlock* const Pred = BB->getSinglePredecessor();
+      if (!Pred) { continue; }
+      BranchInst* const Br = dyn_cast<BranchInst>(Pred->getTerminator());
+      if (!Br || !Br->isConditional()
+          || Br->getSuccessor(0) == Br->getSuccessor(1))
+        { continue; }
+      Value* Checked;
+      TypeFact Fact;
+      bool OnTrue;
+      if (MatchTypeCheck(Br->getCondition(), Checked, Fact, OnTrue)
+          && Checked == V && (Br->getSuccessor(0) == BB) == OnTrue)
+        { return Fact; }
     }
 
-    return changed;
+    // Checked assertions only hold once the check inserted before their call
+    if (!CheckAssumedTypes) {
+      if (Class* const C = GetAssertedClass(V, At)) {
+        const TypeFact Asserted = {C, true};
+        return Asserted;
+      }
+    }
+    return None;
   }
 
-protected:
-  void UpdateCallGraph(const CallInst* const Call, Function* FromFunc) {
-    CallEdge callEdge = {NULL, false, false};
-    if (const MDNode* const VirtualMD = Call->getMetadata("virtual-call")) {
-      if (MDString* const LinkageNameNode =
-          dyn_cast<MDString>(VirtualMD->getOperand(0))) {
-        StringRef ToLinkageName = LinkageNameNode->getString();
-        if (LinkageToMetadata.count(ToLinkageName)) {
-          callEdge.isVirtual = true;
-          callEdge.ToFunc = LinkageToMetadata[ToLinkageName];
+  /**
+   * Returns the class the programmer asserts to be the dynamic class of
+   * Object, or NULL: the one asserted by a virtual call on Object, which is
+   * At or dominates it with nothing in between that may change the object's
+   * vtable pointer
+   */
+  Class* GetAssertedClass(Value* const Object, Instruction* const At) {
+    SmallVector<Value*, 4> Worklist(1, Object);
+    while (!Worklist.empty()) {
+      Value* const V = Worklist.pop_back_val();
+      for (Value::use_iterator U = V->use_begin(); U != V->use_end(); ++U) {
+        if (isa<BitCastInst>(*U)) {
+          Worklist.push_back(*U);
+          continue;
         }
+        CallInst* const Call = dyn_cast<CallInst>(*U);
+        Class* const C = Call ? GetAssertedClass(Call) : NULL;
+        if (!C || GetReceiver(Call)->stripPointerCasts() != Object) {
+          continue;
+        }
+        if (Call != At && (!DT->dominates(Call, At)
+                           || MayChangeVTablePointer(Call, At,
+                                                     GetUnderlyingObject(Object))))
+          { continue; }
+        return C;
       }
     }
-    if (!callEdge.isVirtual) {
-      if (isa<Function>(Call->getCalledValue())) {
-        StringRef LinkageName = Call->getCalledFunction()->getName();
-        if (LinkageToMetadata.count(LinkageName)) {
-          callEdge.ToFunc = LinkageToMetadata[LinkageName];
-        }
-      } else {
-        callEdge.Unknown = true;
+    return NULL;
+  }
+
+  /**
+   * Matches a condition that holds exactly when an object has a given
+   * dynamic class: a comparison of its vtable pointer with an address point
+   * of that class, or of typeid(*object) with the class' type_info. OnTrue
+   * tells whether the fact holds when the condition is true or false
+   */
+  bool MatchTypeCheck(Value* const Cond, Value*& Object, TypeFact& Fact,
+                      bool& OnTrue) {
+    if (BinaryOperator* const BO = dyn_cast<BinaryOperator>(Cond)) {
+      if (BinaryOperator::isNot(BO)) {
+        if (!MatchTypeCheck(BinaryOperator::getNotArgument(BO), Object, Fact,
+                            OnTrue))
+          { return false; }
+        OnTrue = !OnTrue;
+        return true;
+      }
+      // One comparison per address point of the class
+      if (BO->getOpcode() == Instruction::Or) {
+        Value* OtherObject;
+        TypeFact OtherFact;
+        bool OtherOnTrue;
+        return MatchTypeCheck(BO->getOperand(0), Object, Fact, OnTrue)
+               && MatchTypeCheck(BO->getOperand(1), OtherObject, OtherFact,
+                                 OtherOnTrue)
+               && OnTrue && OtherOnTrue && Object == OtherObject
+               && Fact.C == OtherFact.C;
       }
+      return false;
     }
-    if (!callEdge.Unknown && !callEdge.ToFunc) {
-      return; // not a real function (e.g. @llvm.dbg.declare)
+
+    if (ICmpInst* const Cmp = dyn_cast<ICmpInst>(Cond)) {
+      if (!Cmp->isEquality()) { return false; }
+      for (unsigned i = 0; i < 2; ++i) {
+        LoadInst* const VPtr =
+          dyn_cast<LoadInst>(Cmp->getOperand(i)->stripPointerCasts());
+        Constant* const AP = dyn_cast<Constant>(Cmp->getOperand(1 - i));
+        if (!VPtr || !AP) { continue; }
+        GEPOperator* const GEP = dyn_cast<GEPOperator>(AP->stripPointerCasts());
+        if (!GEP || !VTableToClass.count(GEP->getPointerOperand())) { continue; }
+        Object = VPtr->getPointerOperand()->stripPointerCasts();
+        Fact.C = VTableToClass.lookup(GEP->getPointerOperand());
+        Fact.Exact = true;
+        OnTrue = Cmp->getPredicate() == ICmpInst::ICMP_EQ;
+        return true;
+      }
+      return false;
     }
-    FunctionMetadata* FromFuncMD = LinkageToMetadata[FromFunc->getName()];
-    
-    if (!CallGraph.count(FromFuncMD)) {
-      vector<CallEdge> edges;
-      CallGraph.insert(pair<FunctionMetadata*, vector<CallEdge> >(
-        FromFuncMD,
-        edges
-      ));
+
+    if (CallInst* const Call = dyn_cast<CallInst>(Cond)) {
+      const Function* const Callee = Call->getCalledFunction();
+      if (!Callee || (Callee->getName() != "_ZNKSt9type_infoeqERKS_"
+                      && Callee->getName() != "_ZNKSt9type_infoneERKS_"))
+        { return false; }
+      for (unsigned i = 0; i < 2; ++i) {
+        Value* const VPtr = GetDynamicTypeInfoVPtr(Call->getArgOperand(i));
+        Class* const C = GetClassForTypeInfo(Call->getArgOperand(1 - i));
+        if (!VPtr || !C) { continue; }
+        Object = cast<LoadInst>(VPtr->stripPointerCasts())
+                   ->getPointerOperand()->stripPointerCasts();
+        Fact.C = C;
+        Fact.Exact = true;
+        OnTrue = Callee->getName() == "_ZNKSt9type_infoeqERKS_";
+        return true;
+      }
     }
-    CallGraph[FromFuncMD].push_back(callEdge);
+    return false;
   }
 
-  Class* getOrCreateHierarchy(const DICompositeType& type) {
-    const TypeMap::const_iterator typeClass = classes.find(type);
-    if (typeClass != classes.end()) {
-      Class * const c = typeClass->second;
-      /*ferrs() << "Existing class pointer for " << type.getName()
-              << " ("<< ((MDNode*)type) << ") is " << c << '\n';*/
-      return c;
+  /**
+   * Returns the metadata of the method named by a call's virtual-call
+   * annotation, or NULL if the call is not virtual or names an unknown method
+   */
+  FunctionMetadata* GetVirtualCallee(const CallInst* const Call) {
+    const MDNode* const VirtualMD = Call->getMetadata("virtual-call");
+    if (!VirtualMD) { return MatchVirtualCall(Call); }
+    MDString* const LinkageNameNode =
+      dyn_cast<MDString>(VirtualMD->getOperand(0));
+    if (!LinkageNameNode) { return NULL; }
+    if (LinkageToMetadata.count(LinkageNameNode->getString())) {
+      return LinkageToMetadata.lookup(LinkageNameNode->getString());
     }
 
-    // Otherwise, build the hierarchy
-    Class::ClassSet parents;
+    // A method the module has no metadata for is looked up by its vtable
+    // slot in its class, e.g. an inherited method named through a subclass
+    string ClassName, Signature;
+    const ConstantInt* const Slot = VirtualMD->getNumOperands() > 3
+      ? dyn_cast_or_null<ConstantInt>(VirtualMD->getOperand(3)) : NULL;
+    if (!Slot || !SplitMangledMethodName(LinkageNameNode->getString(),
+                                         ClassName, Signature))
+      { return NULL; }
+    return GetVTableMethod(MangledToClass.lookup(ClassName),
+                           Slot->getZExtValue());
+  }
 
-    // Iterate over the fields in the class
-    const DIArray arr = type.getTypeArray();
-    for (size_t a=0; a < arr.getNumElements(); ++a) {
-      const DIDescriptor elem = arr.getElement(a);
-      switch (elem.getTag()) {
-      case dwarf::DW_TAG_inheritance:
-        // This represents a parent type; get its Class and make it a parent of ours
-        DIDerivedType inh = DIDerivedType(elem);
-        inh.getTypeDerivedFrom();
-        Class* parent = getOrCreateHierarchy(DICompositeType(DIDerivedType(elem).getTypeDerivedFrom()));
-        parents.insert(parent);
-        break;
+  /**
+   * Returns the most-derived static class of a virtual call's receiver, as
+   * annotated by the frontend, or NULL if unknown
+   */
+  Class* GetStaticClass(const CallInst* const Call) const {
+    const MDNode* const VirtualMD = Call->getMetadata("virtual-call");
+    const MDString* const TypeInfoName =
+      VirtualMD && VirtualMD->getNumOperands() > 2
+      ? dyn_cast_or_null<MDString>(VirtualMD->getOperand(2)) : NULL;
+    if (!TypeInfoName || !TypeInfoName->getString().startswith("_ZTI")) {
+      return NULL;
+    }
+    return MangledToClass.lookup(TypeInfoName->getString().substr(4));
+  }
+
+  /**
+   * Returns where the receiver of a virtual call comes from, as annotated by
+   * the frontend
+   */
+  ReceiverKind GetReceiverKind(const CallInst* const Call) const {
+    const MDNode* const VirtualMD = Call->getMetadata("virtual-call");
+    const ConstantInt* const Kind =
+      VirtualMD && VirtualMD->getNumOperands() > 4
+      ? dyn_cast_or_null<ConstantInt>(VirtualMD->getOperand(4)) : NULL;
+    if (!Kind || Kind->getZExtValue() > ReceiverUnknown) {
+      return ReceiverUnknown;
+    }
+    return static_cast<ReceiverKind>(Kind->getZExtValue());
+  }
+
+  /**
+   * Returns the class the programmer asserts to be the dynamic class of a
+   * virtual call's receiver, as annotated by the frontend, or NULL if there
+   * is no assertion or the class is unknown
+   */
+  Class* GetAssertedClass(const CallInst* const Call) const {
+    const MDNode* const VirtualMD = Call->getMetadata("virtual-call");
+    const MDString* const TypeInfoName =
+      VirtualMD && VirtualMD->getNumOperands() > 5
+      ? dyn_cast_or_null<MDString>(VirtualMD->getOperand(5)) : NULL;
+    if (!TypeInfoName || !TypeInfoName->getString().startswith("_ZTI")) {
+      return NULL;
+    }
+    return MangledToClass.lookup(TypeInfoName->getString().substr(4));
+  }
+
+  /**
+   * Traps before a call devirtualized on an asserted dynamic type unless the
+   * receiver's vtable pointer points into the vtable group of C, i.e. the
+   * object is of class C. Null receivers are left to fault in the call
+   */
+  void CheckAssumedType(CallInst* const Call, Value* const Receiver,
+                        Class* const C) {
+    BasicBlock* const BB = Call->getParent();
+    Function* const F = BB->getParent();
+    LLVMContext& Context = F->getContext();
+    BasicBlock* const Cont = BB->splitBasicBlock(Call, "devirt.checked");
+    BB->getTerminator()->eraseFromParent();
+    BasicBlock* const Trap =
+      BasicBlock::Create(Context, "devirt.mismatch", F, Cont);
+    IRBuilder<> Builder(Trap);
+    Builder.CreateCall(Intrinsic::getDeclaration(F->getParent(), Intrinsic::trap));
+    Builder.CreateUnreachable();
+
+    Builder.SetInsertPoint(BB);
+    BasicBlock* const Check =
+      BasicBlock::Create(Context, "devirt.check", F, Trap);
+    Builder.CreateCondBr(Builder.CreateIsNull(Receiver), Cont, Check);
+    Builder.SetInsertPoint(Check);
+    const Type* const VPtrTy = Builder.getInt8PtrTy();
+    Value* const VPtr = Builder.CreateLoad(Builder.CreateBitCast(Receiver,
+      PointerType::getUnqual(VPtrTy)), "vtable");
+    GlobalVariable* const VTable = C->getVTable();
+    Constant* const One = ConstantInt::get(Type::getInt64Ty(Context), 1);
+    Value* const InGroup = Builder.CreateAnd(
+      Builder.CreateICmpUGE(VPtr, ConstantExpr::getBitCast(VTable, VPtrTy)),
+      Builder.CreateICmpULT(VPtr, ConstantExpr::getBitCast(
+        ConstantExpr::getGetElementPtr(VTable, &One, 1), VPtrTy)));
+    Builder.CreateCondBr(InGroup, Cont, Trap);
+  }
+
+  /**
+   * Returns the metadata of the method in a slot of the primary vtable of C,
+   * or NULL if there is no such method. The primary vtable ends with the
+   * offset-to-top entry of the next address point, if any
+   */
+  FunctionMetadata* GetVTableMethod(const Class* const C, const uint64_t Slot) {
+    if (!C || C->getAddressPoints().empty()) { return NULL; }
+    const Class::AddressPointList& AddressPoints = C->getAddressPoints();
+    const ConstantArray* const Entries =
+      cast<ConstantArray>(C->getVTable()->getInitializer());
+    const uint64_t End = AddressPoints.size() > 1
+      ? AddressPoints[1].Index - 2 : Entries->getNumOperands();
+    const uint64_t Index = AddressPoints.front().Index + Slot;
+    if (Index >= End) { return NULL; }
+    const Function* const Method =
+      dyn_cast<Function>(Entries->getOperand(Index)->stripPointerCasts());
+    if (!Method || !LinkageToMetadata.count(Method->getName())) { return NULL; }
+    return LinkageToMetadata.lookup(Method->getName());
+  }
+
+  /**
+   * Recognizes a virtual call without virtual-call annotation, as emitted by
+   * other frontends: an indirect call through a function pointer loaded from
+   * a slot of the vtable whose pointer is loaded from the receiver. The
+   * method is the one in that slot of the vtable of the receiver's class
+   */
+  FunctionMetadata* MatchVirtualCall(const CallInst* const Call) {
+    if (GetDirectCallee(Call) || !Call->getNumArgOperands()) {
+      return NULL;
+    }
+    const LoadInst* const FunctionPtr =
+      dyn_cast<LoadInst>(Call->getCalledValue()->stripPointerCasts());
+    if (!FunctionPtr) { return NULL; }
+    const Value* SlotPtr = FunctionPtr->getPointerOperand()->stripPointerCasts();
+    uint64_t Slot = 0;
+    if (const GEPOperator* const GEP = dyn_cast<GEPOperator>(SlotPtr)) {
+      const ConstantInt* const Index = GEP->getNumIndices() == 1
+        ? dyn_cast<ConstantInt>(GEP->getOperand(1)) : NULL;
+      const Type* const EntryTy = cast<PointerType>(GEP->getType())
+        ->getElementType();
+      if (!Index || !EntryTy->isPointerTy()) { return NULL; }
+      Slot = Index->getZExtValue();
+      SlotPtr = GEP->getPointerOperand();
+    }
+    const LoadInst* const VPtr = dyn_cast<LoadInst>(SlotPtr);
+    Value* const Receiver = GetReceiver(Call);
+    if (!VPtr || VPtr->getPointerOperand()->stripPointerCasts()
+                 != Receiver->stripPointerCasts())
+      { return NULL; }
+
+    const PointerType* const ReceiverTy =
+      dyn_cast<PointerType>(Receiver->getType());
+    Class* const Static = ReceiverTy ? GetClassForIRType(
+      *Call->getParent()->getParent()->getParent(),
+      ReceiverTy->getElementType()) : NULL;
+    return GetVTableMethod(Static, Slot);
+  }
+
+  /**
+   * Whether a virtual call is made on this, as annotated by the frontend or,
+   * for unannotated calls, when the receiver is the caller's first argument
+   * and the caller a method
+   */
+  bool IsCallOnThis(const CallInst* const Call) {
+    if (const MDNode* const VirtualMD = Call->getMetadata("virtual-call")) {
+      if (VirtualMD->getNumOperands() > 4) {
+        return GetReceiverKind(Call) == ReceiverThis;
       }
+      const ConstantInt* const OnThis =
+        dyn_cast<ConstantInt>(VirtualMD->getOperand(1));
+      return OnThis && OnThis->isOne();
     }
+    const Function* const Caller = Call->getParent()->getParent();
+    return !Caller->arg_empty() && LinkageToMetadata.count(Caller->getName())
+           && GetReceiver(Call)->stripPointerCasts() == &*Caller->arg_begin();
+  }
 
-    Class* const c = new Class(type.getName(), parents);
-    /*ferrs() << "New class pointer for " << type.getName()
-            << " (" << ((MDNode*)type) << ") is " << c << '\n';*/
-    foreach (Class::ClassSet, parents, i) {
-      (*i)->getChildren().insert(c);
+  /**
+   * Exposes a memory effect summary to later passes (GVN, LICM) through the
+   * readnone/readonly call site attributes
+   */
+  bool SetCallMemoryEffect(CallInst* const Call, MemoryEffect Effect) {
+    if (Effect == ReadNone && !Call->doesNotAccessMemory()) {
+      Call->setDoesNotAccessMemory();
+      return true;
     }
+    if (Effect == ReadOnly && !Call->onlyReadsMemory()
+        && !Call->doesNotAccessMemory()) {
+      Call->setOnlyReadsMemory();
+      return true;
+    }
+    return false;
+  }
 
-    classes.insert(pair<MDNode*, Class*>((MDNode*)type, c));
-    return c;
+  /**
+   * Returns the whole-program memory effect of a virtual call to MD, that is
+   * the merged effects of MD and of every method that overrides it. Classes
+   * outside the module may override MD unless its class is closed
+   */
+  MemoryEffect GetSignatureEffect(FunctionMetadata* MD) {
+    if (SignatureEffects.count(MD)) { return SignatureEffects.lookup(MD); }
+    if (!OverriddenByMap.count(MD) || !classes.count(MD->ContainingType)
+        || !IsClosed(classes.lookup(MD->ContainingType)))
+      { return MayWrite; } // unknown overriders
+    SignatureEffects[MD] = MayWrite; // in case the signature is recursive
+
+    MemoryEffect Effect = GetFunctionEffect(MD);
+    const MDSet& OverriddenBy = OverriddenByMap.lookup(MD);
+    foreachI (MDSet, OverriddenBy, Overrider, const_iterator) {
+      Effect = max(Effect, GetFunctionEffect(*Overrider));
+    }
+    SignatureEffects[MD] = Effect;
+    return Effect;
   }
 
-  bool runOnFunction(Function& f) {
-    bool changed = false;
-    foreach (Function, f, i) {
-      changed |= runOnBasicBlock(*i);
+  MemoryEffect GetFunctionEffect(FunctionMetadata* MD) {
+    if (MD->Virtuality == dwarf::DW_VIRTUALITY_pure_virtual) {
+      return ReadNone; // never the target of a call
     }
-    return changed;
+    if (FunctionEffects.count(MD)) { return FunctionEffects.lookup(MD); }
+    if (!MD->Func) { return MayWrite; }
+    FunctionEffects[MD] = MayWrite; // in case the function is recursive
+
+    const MemoryEffect Effect = ComputeFunctionEffect(*MD->Func);
+    FunctionEffects[MD] = Effect;
+    return Effect;
   }
 
-  bool runOnBasicBlock(BasicBlock& bb) {
-    bool changed = false;
-    foreach (BasicBlock, bb, i) {
-      if (CallInst* const Call = dyn_cast<CallInst>(&*i)) {
-        if (const MDNode* const VirtualMD = Call->getMetadata("virtual-call")) {
-          if (MDString* const LinkageNameNode =
-              dyn_cast<MDString>(VirtualMD->getOperand(0))) {
-            StringRef LinkageName = LinkageNameNode->getString();
-            if (!LinkageToMetadata.count(LinkageName)) {
-              continue;
-            }
-            FunctionMetadata* MD = LinkageToMetadata[LinkageName];
-            if (MD->Virtuality) {
-              ConstantInt* const IsCallOnThis =
-                dyn_cast<ConstantInt>(VirtualMD->getOperand(1));
-              if (CanDevirt(MD, Call, IsCallOnThis->isOne())) {
-                Call->setCalledFunction(MD->Func);
-                ferrs() << "Devirtualized:\n";
-                Call->dump();
-                changed = true;
-              }
-            }
-          }
+  MemoryEffect ComputeFunctionEffect(const Function& F) {
+    if (F.doesNotAccessMemory()) { return ReadNone; }
+    const MemoryEffect Declared = F.onlyReadsMemory() ? ReadOnly : MayWrite;
+    if (F.isDeclaration() || F.mayBeOverridden()) { return Declared; }
+
+    MemoryEffect Effect = ReadNone;
+    foreachI (Function, F, bb, const_iterator) {
+      foreachI (BasicBlock, *bb, i, const_iterator) {
+        Effect = max(Effect, GetInstructionEffect(*i));
+        if (Effect >= Declared) { return Declared; }
+      }
+    }
+    return Effect;
+  }
+
+  MemoryEffect GetInstructionEffect(const Instruction& I) {
+    if (const LoadInst* const Load = dyn_cast<LoadInst>(&I)) {
+      if (Load->isVolatile()) { return MayWrite; }
+      return IsLocalMemory(Load->getPointerOperand()) ? ReadNone : ReadOnly;
+    }
+    if (const StoreInst* const Store = dyn_cast<StoreInst>(&I)) {
+      if (Store->isVolatile()) { return MayWrite; }
+      return IsLocalMemory(Store->getPointerOperand()) ? ReadNone : MayWrite;
+    }
+    if (const CallInst* const Call = dyn_cast<CallInst>(&I)) {
+      if (Call->doesNotAccessMemory()) { return ReadNone; }
+      const MemoryEffect Declared = Call->onlyReadsMemory() ? ReadOnly : MayWrite;
+      if (FunctionMetadata* const MD = GetVirtualCallee(Call)) {
+        if (MD->Virtuality && !GetDirectCallee(Call)) {
+          return min(Declared, GetSignatureEffect(MD));
+        }
+      }
+      if (const Function* const Callee = GetDirectCallee(Call)) {
+        if (LinkageToMetadata.count(Callee->getName())) {
+          return min(Declared,
+                     GetFunctionEffect(LinkageToMetadata.lookup(Callee->getName())));
         }
       }
+      return Declared;
     }
-    return changed;
+    if (I.mayWriteToMemory()) { return MayWrite; }
+    return I.mayReadFromMemory() ? ReadOnly : ReadNone;
   }
 
+  /**
+   * Adds a subprogram to the metadata of the function it declares or defines.
+   * The in-class declaration of a destructor has no linkage name, but only it
+   * says that the destructor is virtual, while the definitions of its
+   * variants do not. It is keyed by the complete (D1) and deleting (D0)
+   * variants the vtable holds, in this order, so that their definitions
+   * complete it
+   */
   void UpdateLinkageToMetadata(const DISubprogram& Subprogram) {
     StringRef LinkageName = Subprogram.getLinkageName();
+    if (LinkageName.empty() && Subprogram.getName().startswith("~")
+        && Subprogram.getVirtuality()
+        && IsClassType(Subprogram.getContainingType())) {
+      const string ClassName =
+        GetMangledClassName(Subprogram.getContainingType());
+      if (!ClassName.empty()) {
+        UpdateLinkageToMetadata(Subprogram, "_ZN" + ClassName + "D1Ev",
+                                Subprogram.getVirtualIndex());
+        UpdateLinkageToMetadata(Subprogram, "_ZN" + ClassName + "D0Ev",
+                                Subprogram.getVirtualIndex() + 1);
+        return;
+      }
+    }
     if (LinkageName.empty()) {
       LinkageName = Subprogram.getName();
     }
+    UpdateLinkageToMetadata(Subprogram, LinkageName,
+                            Subprogram.getVirtualIndex());
+  }
+
+  void UpdateLinkageToMetadata(const DISubprogram& Subprogram,
+                               const StringRef LinkageName,
+                               const unsigned VirtualIndex) {
     FunctionMetadata* MD;
     if (LinkageToMetadata.count(LinkageName)) {
       MD = LinkageToMetadata.lookup(LinkageName);
@@ -416,17 +3601,20 @@ protected:
       }
       if (!MD->Virtuality) {
     	  MD->Virtuality = Subprogram.getVirtuality();
-    	  MD->VirtualIndex = Subprogram.getVirtualIndex();
+    	  MD->VirtualIndex = VirtualIndex;
       }
-      if (!MD->ContainingType.Verify()
-    		|| MD->ContainingType.getTag() != dwarf::DW_TAG_class_type)
+      if (!IsClassType(MD->ContainingType))
         {
     	  MD->ContainingType = Subprogram.getContainingType();
         }
     } else {
+      // The metadata refers to the key, as LinkageName may be built here
+      StringMapEntry<FunctionMetadata*>& Entry =
+        LinkageToMetadata.GetOrCreateValue(LinkageName);
       MD = new FunctionMetadata;
-      *MD = FromSubprogram(Subprogram);
-      LinkageToMetadata.GetOrCreateValue(LinkageName, MD);
+      *MD = FromSubprogram(Subprogram, Entry.getKey());
+      MD->VirtualIndex = VirtualIndex;
+      Entry.setValue(MD);
     }
   }
 
@@ -454,7 +3642,8 @@ protected:
     if (MD->Virtuality) {
       foreach (SignatureEquSetMap, SignatureEquSets, EquSetIter) {
         FunctionMetadata* const BaseMD = EquSetIter->first;
-        if (BaseMD->Name.equals(MD->Name) && BaseMD->Type == MD->Type) {
+        if (BaseMD->Name.equals(MD->Name)
+            && SameParameters(BaseMD->Type, MD->Type)) {
           return &EquSetIter->second;
         }
       }
@@ -469,7 +3658,10 @@ protected:
     return NoOverriders(MD) || PairwiseDevirt(MD, Call, IsCallOnThis); // Can devirt by type info
   }
 
-  bool NoOverriders(FunctionMetadata* MD) const {
+  bool NoOverriders(FunctionMetadata* MD) {
+    if (!classes.count(MD->ContainingType)
+        || !IsClosed(classes.lookup(MD->ContainingType)))
+      { return false; }
     if (OverriddenByMap.count(MD)) {
       const MDSet& OverriddenBy = OverriddenByMap.lookup(MD);
       return OverriddenBy.size() == 0;
@@ -490,6 +3682,7 @@ protected:
     if (!InFuncMD || !classes.count(InFuncMD->ContainingType)) { return false; }
     Class* const InFuncClass = classes.lookup(InFuncMD->ContainingType);
     Class* const CalledClass = classes.lookup(MD->ContainingType);
+    if (!IsClosed(InFuncClass) || !IsClosed(CalledClass)) { return false; }
     
     if (   !InFuncClass->isSubclassOf(CalledClass)
         && !CalledClass->isSubclassOf(InFuncClass))
@@ -548,4 +3741,85 @@ protected:
 
 char DevirtualizationPass::ID= 0;
 static RegisterPass<DevirtualizationPass>X("devirt", "Devirtualize virtual function calls", false, false);
+
+/*
+ * Alias analysis from the rules on dynamic types: only constructors and
+ * destructors write the vtable pointer of an object, which no typed access
+ * reads or writes either. Copying memory may write it too, as may inline
+ * assembly
+ */
+class VTablePointerAA : public ModulePass, public AliasAnalysis {
+public:
+  static char ID;
+
+  VTablePointerAA(void) : ModulePass(ID) {}
+
+  virtual void getAnalysisUsage(AnalysisUsage& AU) const {
+    AliasAnalysis::getAnalysisUsage(AU);
+    AU.setPreservesAll();
+  }
+
+  virtual bool runOnModule(Module& m) {
+    InitializeAliasAnalysis(this);
+    return false;
+  }
+
+  virtual void* getAdjustedAnalysisPointer(const void* PI) {
+    if (PI == &AliasAnalysis::ID) { return (AliasAnalysis*)this; }
+    return this;
+  }
+
+  virtual AliasResult alias(const Location& LocA, const Location& LocB) {
+    if ((IsVTablePointer(LocA) && IsTypedAccess(LocB))
+        || (IsVTablePointer(LocB) && IsTypedAccess(LocA)))
+      { return NoAlias; }
+    return AliasAnalysis::alias(LocA, LocB);
+  }
+
+  virtual ModRefResult getModRefInfo(ImmutableCallSite CS,
+                                     const Location& Loc) {
+    const ModRefResult Result = AliasAnalysis::getModRefInfo(CS, Loc);
+    if (!IsVTablePointer(Loc) || isa<InlineAsm>(CS.getCalledValue())
+        || isa<MemIntrinsic>(CS.getInstruction()))
+      { return Result; }
+    const Function* const Callee = CS.getCalledFunction();
+    if (Callee && IsConstructorOrDestructor(Callee->getName())) {
+      return Result;
+    }
+    return ModRefResult(Result & Ref);
+  }
+
+protected:
+  /**
+   * Whether a location is the vtable pointer of an object, as tagged by the
+   * frontend
+   */
+  static bool IsVTablePointer(const Location& Loc) {
+    const MDString* const Name = Loc.TBAATag && Loc.TBAATag->getNumOperands()
+      ? dyn_cast_or_null<MDString>(Loc.TBAATag->getOperand(0)) : NULL;
+    return Name && Name->getString() == "vtable pointer";
+  }
+
+  /**
+   * Whether a location is accessed as an object of some C or C++ type, i.e.
+   * has a TBAA tag outside of the frontend's vtables tree
+   */
+  static bool IsTypedAccess(const Location& Loc) {
+    const MDNode* Node = Loc.TBAATag;
+    if (!Node) { return false; }
+    for (unsigned Depth = 0; Node->getNumOperands() > 1 && Depth < 16; ++Depth) {
+      const MDNode* const Parent = dyn_cast_or_null<MDNode>(Node->getOperand(1));
+      if (!Parent) { return false; }
+      Node = Parent;
+    }
+    const MDString* const Root = Node->getNumOperands()
+      ? dyn_cast_or_null<MDString>(Node->getOperand(0)) : NULL;
+    return Root && Root->getString() != "vtables";
+  }
+};
+
+char VTablePointerAA::ID = 0;
+static RegisterPass<VTablePointerAA> Y("vtable-pointer-aa",
+  "Alias analysis from the rules on vtable pointers", false, true);
+static RegisterAnalysisGroup<AliasAnalysis> Z(Y);
 }
@@ -97,8 +97,8 @@ public:
     : CallExpr(C, CXXMemberCallExprClass, Empty) { }
 
   /// getImplicitObjectArgument - Retrieves the implicit object
-  /// argument for the member call. For example, in "x.f(5)", this
-  /// operation would return "x".
+  /// argument for the member call. For example, in "x.f(5)" or
+  /// "(x.*pmf)(5)", this operation would return "x".
   Expr *getImplicitObjectArgument() const;
 
   /// getRecordDecl - Retrieves the CXXRecordDecl for the underlying type of
@@ -385,10 +385,15 @@ SourceRange CXXOperatorCallExpr::getSourceRange() const {
 }
 
 Expr *CXXMemberCallExpr::getImplicitObjectArgument() const {
-  if (const MemberExpr *MemExpr = dyn_cast<MemberExpr>(getCallee()->IgnoreParens()))
+  const Expr *Callee = getCallee()->IgnoreParens();
+  if (const MemberExpr *MemExpr = dyn_cast<MemberExpr>(Callee))
     return MemExpr->getBase();
 
-  // FIXME: Will eventually need to cope with member pointers.
+  // A call through a pointer to member function, (x.*pmf)(5) or (p->*pmf)(5).
+  if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(Callee))
+    if (BO->isPtrMemOp())
+      return BO->getLHS();
+
   return 0;
 }
 
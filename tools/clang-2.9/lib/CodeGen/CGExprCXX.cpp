@@ -11,6 +11,11 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "clang/AST/Attr.h"
+#include "clang/AST/CXXInheritance.h"
+#include "clang/AST/DeclTemplate.h"
+#include "clang/AST/Mangle.h"
+#include "clang/AST/RecordLayout.h"
 #include "clang/Frontend/CodeGenOptions.h"
 #include "CodeGenFunction.h"
 #include "CGCXXABI.h"
@@ -19,6 +24,10 @@
 #include "llvm/Intrinsics.h"
 #include "llvm/Metadata.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Mutex.h"
 using namespace clang;
 using namespace CodeGen;
 
@@ -80,11 +89,211 @@ static const CXXRecordDecl *getMostDerivedClassDecl(const Expr *Base) {
   return cast<CXXRecordDecl>(DerivedType->castAs<RecordType>()->getDecl());
 }
 
+/// overridesMethod - Checks whether the given method overrides MD, directly or
+/// through the methods it overrides.
+static bool overridesMethod(const CXXMethodDecl *Method,
+                            const CXXMethodDecl *MD) {
+  for (CXXMethodDecl::method_iterator I = Method->begin_overridden_methods(),
+       E = Method->end_overridden_methods(); I != E; ++I) {
+    if ((*I)->getCanonicalDecl() == MD->getCanonicalDecl() ||
+        overridesMethod(*I, MD))
+      return true;
+  }
+  return false;
+}
+
+/// OverriderMap - Maps each virtual method, by canonical declaration, to the
+/// classes of the translation unit that override it, directly or through the
+/// methods they override.
+typedef llvm::DenseMap<const CXXMethodDecl *,
+                       llvm::SmallVector<const CXXRecordDecl *, 4> >
+  OverriderMap;
+
+/// addOverriders - Adds the methods overridden by Method, transitively, to
+/// the overrider map entry of the class RD.
+static void addOverriders(OverriderMap &Map, const CXXRecordDecl *RD,
+                          const CXXMethodDecl *Method) {
+  for (CXXMethodDecl::method_iterator I = Method->begin_overridden_methods(),
+       E = Method->end_overridden_methods(); I != E; ++I) {
+    llvm::SmallVector<const CXXRecordDecl *, 4> &Classes =
+      Map[(*I)->getCanonicalDecl()];
+    if (Classes.empty() || Classes.back() != RD)
+      Classes.push_back(RD);
+    addOverriders(Map, RD, *I);
+  }
+}
+
+static void collectOverriders(OverriderMap &Map, const DeclContext *DC);
+
+/// collectClassOverriders - Adds the methods of RD to the overrider map, and
+/// the classes nested in it.
+static void collectClassOverriders(OverriderMap &Map,
+                                   const CXXRecordDecl *RD) {
+  if (RD->isDefinition() && RD->isDynamicClass())
+    for (CXXRecordDecl::method_iterator I = RD->method_begin(),
+         E = RD->method_end(); I != E; ++I)
+      addOverriders(Map, RD, *I);
+  collectOverriders(Map, RD);
+}
+
+/// collectOverriders - Fills the overrider map with the classes defined in
+/// the given declaration context, or nested in it.
+static void collectOverriders(OverriderMap &Map, const DeclContext *DC) {
+  for (DeclContext::decl_iterator I = DC->decls_begin(), E = DC->decls_end();
+       I != E; ++I) {
+    if (const ClassTemplateDecl *CTD = dyn_cast<ClassTemplateDecl>(*I)) {
+      for (ClassTemplateDecl::spec_iterator S = CTD->spec_begin(),
+           SE = CTD->spec_end(); S != SE; ++S)
+        collectClassOverriders(Map, *S);
+      continue;
+    }
+
+    if (const CXXRecordDecl *RD = dyn_cast<CXXRecordDecl>(*I))
+      collectClassOverriders(Map, RD);
+    else if (const DeclContext *Inner = dyn_cast<DeclContext>(*I))
+      collectOverriders(Map, Inner);
+  }
+}
+
+namespace {
+  /// ContextOverriders - The overrider map of the translation unit of an
+  /// ASTContext, which owns it: it is freed along with the context.
+  struct ContextOverriders {
+    const ASTContext *Context;
+    OverriderMap Overriders;
+  };
+}
+
+typedef llvm::DenseMap<const ASTContext *, ContextOverriders *>
+  ContextOverridersMap;
+
+/// The overrider maps of the live ASTContexts, which may belong to several
+/// threads.
+static llvm::ManagedStatic<ContextOverridersMap> AllContextOverriders;
+static llvm::ManagedStatic<llvm::sys::SmartMutex<true> > ContextOverridersLock;
+
+static void freeContextOverriders(void *Data) {
+  ContextOverriders *Entry = static_cast<ContextOverriders *>(Data);
+  {
+    llvm::sys::SmartScopedLock<true> Guard(*ContextOverridersLock);
+    AllContextOverriders->erase(Entry->Context);
+  }
+  delete Entry;
+}
+
+/// getOverriders - Returns the overrider map of the translation unit of
+/// Context, which is collected on the first query. The queries only come
+/// from deferred functions, so once every class has been seen.
+static const OverriderMap &getOverriders(ASTContext &Context) {
+  {
+    llvm::sys::SmartScopedLock<true> Guard(*ContextOverridersLock);
+    if (ContextOverriders *Entry = AllContextOverriders->lookup(&Context))
+      return Entry->Overriders;
+  }
+
+  ContextOverriders *Entry = new ContextOverriders;
+  Entry->Context = &Context;
+  collectOverriders(Entry->Overriders, Context.getTranslationUnitDecl());
+  Context.AddDeallocation(freeContextOverriders, Entry);
+  llvm::sys::SmartScopedLock<true> Guard(*ContextOverridersLock);
+  (*AllContextOverriders)[&Context] = Entry;
+  return Entry->Overriders;
+}
+
+/// hasOverriderInContext - Checks whether a class of the translation unit
+/// overrides MD in the hierarchy of MostDerived: derived from it, or one of
+/// its bases between it and the class of MD.
+static bool hasOverriderInContext(ASTContext &Context,
+                                  const CXXRecordDecl *MostDerived,
+                                  const CXXMethodDecl *MD) {
+  const OverriderMap &Overriders = getOverriders(Context);
+  OverriderMap::const_iterator Found =
+    Overriders.find(MD->getCanonicalDecl());
+  if (Found == Overriders.end())
+    return false;
+
+  const CXXRecordDecl *Class = MD->getParent();
+  for (unsigned I = 0, E = Found->second.size(); I != E; ++I) {
+    const CXXRecordDecl *RD = Found->second[I];
+    if (RD == Class || !RD->isDerivedFrom(Class))
+      continue;
+    if (RD == MostDerived || RD->isDerivedFrom(MostDerived) ||
+        MostDerived->isDerivedFrom(RD))
+      return true;
+  }
+  return false;
+}
+
+/// isCompleteObjectExpr - Checks whether the given expression designates a
+/// complete object of its own class type, so that its dynamic type is its
+/// static type.
+static bool isCompleteObjectExpr(const Expr *Base, unsigned Depth = 0) {
+  Base = Base->IgnoreParens();
+
+  // Adding qualifiers does not change the object.
+  if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(Base)) {
+    if (ICE->getCastKind() == CK_NoOp)
+      return isCompleteObjectExpr(ICE->getSubExpr(), Depth);
+    return false;
+  }
+
+  if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Base)) {
+    if (const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl())) {
+      // This is a record decl. We know the type and can devirtualize it.
+      if (VD->getType()->isRecordType())
+        return true;
+
+      // So is a reference bound directly to such an object, e.g.
+      //
+      // A a;
+      // A &r = a;
+      // r.f();
+      //
+      // (The initializer of a parameter is its default argument.)
+      return VD->getType()->isReferenceType() && !isa<ParmVarDecl>(VD) &&
+             VD->getInit() && Depth < 4 &&
+             isCompleteObjectExpr(VD->getInit(), Depth + 1);
+    }
+    
+    return false;
+  }
+
+  // The elements of an array are complete objects of its element type.
+  if (const ArraySubscriptExpr *ASE = dyn_cast<ArraySubscriptExpr>(Base)) {
+    const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(ASE->getBase());
+    return ICE && ICE->getCastKind() == CK_ArrayToPointerDecay &&
+           ASE->getType()->isRecordType();
+  }
+
+  // So are the members of a class held by value.
+  if (const MemberExpr *ME = dyn_cast<MemberExpr>(Base)) {
+    if (const FieldDecl *FD = dyn_cast<FieldDecl>(ME->getMemberDecl()))
+      return FD->getType()->isRecordType();
+    return false;
+  }
+  
+  // We can always devirtualize calls on temporary object expressions.
+  if (isa<CXXConstructExpr>(Base))
+    return true;
+  
+  // And calls on bound temporaries.
+  if (isa<CXXBindTemporaryExpr>(Base))
+    return true;
+  
+  // Check if this is a call expr that returns a record type.
+  if (const CallExpr *CE = dyn_cast<CallExpr>(Base))
+    return CE->getCallReturnType()->isRecordType();
+
+  // We can't devirtualize the call.
+  return false;
+}
+
 /// canDevirtualizeMemberFunctionCalls - Checks whether virtual calls on given
-/// expr can be devirtualized.
+/// expr can be devirtualized. CurFuncDecl is the function being emitted.
 static bool canDevirtualizeMemberFunctionCalls(ASTContext &Context,
                                                const Expr *Base, 
-                                               const CXXMethodDecl *MD) {
+                                               const CXXMethodDecl *MD,
+                                               const Decl *CurFuncDecl) {
   
   // When building with -fapple-kext, all calls must go through the vtable since
   // the kernel linker can do runtime patching of vtables.
@@ -115,38 +324,327 @@ static bool canDevirtualizeMemberFunctionCalls(ASTContext &Context,
   if (MD->getParent()->hasAttr<FinalAttr>())
     return true;
 
-  if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Base)) {
-    if (const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl())) {
-      // This is a record decl. We know the type and can devirtualize it.
-      return VD->getType()->isRecordType();
-    }
-    
-    return false;
-  }
-  
-  // We can always devirtualize calls on temporary object expressions.
-  if (isa<CXXConstructExpr>(Base))
-    return true;
-  
-  // And calls on bound temporaries.
-  if (isa<CXXBindTemporaryExpr>(Base))
+  // A class without external linkage (e.g. in an anonymous namespace) can
+  // only be derived from in this translation unit. Deferred functions are
+  // emitted once the whole translation unit has been parsed, so if no class
+  // seen by then overrides the member function, it is the one to call.
+  if (CurFuncDecl && isa<FunctionDecl>(CurFuncDecl) &&
+      !Context.DeclMustBeEmitted(CurFuncDecl) &&
+      MostDerivedClassDecl->getLinkage() != ExternalLinkage &&
+      !MD->isPure() && !isa<CXXDestructorDecl>(MD) &&
+      !hasOverriderInContext(Context, MostDerivedClassDecl, MD))
     return true;
-  
-  // Check if this is a call expr that returns a record type.
-  if (const CallExpr *CE = dyn_cast<CallExpr>(Base))
-    return CE->getCallReturnType()->isRecordType();
 
-  // We can't devirtualize the call.
+  return isCompleteObjectExpr(Base);
+}
+
+/// Where the receiver of a virtual call comes from, as recorded in the
+/// virtual-call metadata.
+enum VirtualCallReceiverKind {
+  VCR_This,
+  VCR_Parameter,
+  VCR_Field,
+  VCR_Local,
+  VCR_New,
+  VCR_Unknown
+};
+
+/// getVirtualCallReceiverKind - Classifies the object expression of a virtual
+/// call.
+static VirtualCallReceiverKind getVirtualCallReceiverKind(const Expr *Obj) {
+  Obj = Obj->IgnoreParenImpCasts();
+  if (isa<CXXThisExpr>(Obj))
+    return VCR_This;
+  if (isa<CXXNewExpr>(Obj))
+    return VCR_New;
+  if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Obj)) {
+    if (isa<ParmVarDecl>(DRE->getDecl()))
+      return VCR_Parameter;
+    if (const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+      if (VD->hasLocalStorage())
+        return VCR_Local;
+  }
+  if (const MemberExpr *ME = dyn_cast<MemberExpr>(Obj))
+    if (isa<FieldDecl>(ME->getMemberDecl()))
+      return VCR_Field;
+  return VCR_Unknown;
+}
+
+/// hasAnnotation - Checks whether D carries __attribute__((annotate(Name))).
+static bool hasAnnotation(const Decl *D, llvm::StringRef Name) {
+  for (specific_attr_iterator<AnnotateAttr>
+       I = D->specific_attr_begin<AnnotateAttr>(),
+       E = D->specific_attr_end<AnnotateAttr>(); I != E; ++I) {
+    if ((*I)->getAnnotation() == Name)
+      return true;
+  }
   return false;
 }
 
+/// getAnnotatedClass - Returns the class an object, pointer or reference of
+/// type T designates, or null.
+static const CXXRecordDecl *getAnnotatedClass(QualType T) {
+  if (const PointerType *PTy = T->getAs<PointerType>())
+    T = PTy->getPointeeType();
+  else if (const ReferenceType *RTy = T->getAs<ReferenceType>())
+    T = RTy->getPointeeType();
+  return T->getAsCXXRecordDecl();
+}
+
+/// getAssumedDynamicClass - Returns the class the programmer asserts the
+/// object of a virtual call to be exactly of, or null. The assertion is either
+/// an exact_type annotation on the variable, parameter or field the object is
+/// reached through:
+///
+///   Shape *S __attribute__((annotate("exact_type")));
+///
+/// or a call to a function annotated assume_dynamic_type, which returns its
+/// argument as a pointer to the asserted class:
+///
+///   template <class T> T *assume_dynamic_type(T *P)
+///     __attribute__((annotate("assume_dynamic_type")));
+///   assume_dynamic_type<Circle>(Pool.get())->draw();
+static const CXXRecordDecl *getAssumedDynamicClass(const Expr *Obj) {
+  Obj = Obj->IgnoreParenImpCasts();
+  const ValueDecl *D = 0;
+  if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Obj))
+    D = DRE->getDecl();
+  else if (const MemberExpr *ME = dyn_cast<MemberExpr>(Obj))
+    D = ME->getMemberDecl();
+  if (D && (isa<VarDecl>(D) || isa<FieldDecl>(D)) &&
+      hasAnnotation(D, "exact_type"))
+    return getAnnotatedClass(D->getType());
+
+  if (const CallExpr *CE = dyn_cast<CallExpr>(Obj)) {
+    const FunctionDecl *FD = CE->getDirectCallee();
+    if (FD && hasAnnotation(FD, "assume_dynamic_type"))
+      return getAnnotatedClass(CE->getType());
+  }
+  return 0;
+}
+
+/// getNewObjectClass - Returns the class of the object a pointer variable
+/// with local storage is initialized with a new-expression of, or null.
+static const CXXRecordDecl *getNewObjectClass(const VarDecl *VD) {
+  if (!VD->hasLocalStorage() || !VD->getType()->isPointerType() ||
+      VD->getType().isVolatileQualified() || VD->hasAttr<BlocksAttr>() ||
+      !VD->getInit())
+    return 0;
+  const CXXNewExpr *NE =
+    dyn_cast<CXXNewExpr>(VD->getInit()->IgnoreParenImpCasts());
+  if (!NE || NE->isArray())
+    return 0;
+  return NE->getAllocatedType()->getAsCXXRecordDecl();
+}
+
+namespace {
+  /// The uses of the local variables of a function: how many times each is
+  /// referenced, and how many of these references only read its value.
+  struct LocalVarUses {
+    llvm::DenseMap<const VarDecl *, const CXXRecordDecl *> NewObjects;
+    llvm::DenseMap<const VarDecl *, unsigned> References;
+    llvm::DenseMap<const VarDecl *, unsigned> Reads;
+  };
+}
+
+/// scanLocalVarUses - Records the variables initialized by new-expressions
+/// and the uses of variables in a statement.
+static void scanLocalVarUses(const Stmt *S, LocalVarUses &Uses) {
+  if (!S)
+    return;
+
+  if (const DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+    for (DeclStmt::const_decl_iterator I = DS->decl_begin(),
+         E = DS->decl_end(); I != E; ++I) {
+      if (const VarDecl *VD = dyn_cast<VarDecl>(*I))
+        if (const CXXRecordDecl *RD = getNewObjectClass(VD))
+          Uses.NewObjects[VD] = RD;
+    }
+  } else if (const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+    if (const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+      ++Uses.References[VD];
+  } else if (const ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(S)) {
+    const DeclRefExpr *DRE =
+      dyn_cast<DeclRefExpr>(ICE->getSubExpr()->IgnoreParens());
+    if (ICE->getCastKind() == CK_LValueToRValue && DRE)
+      if (const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+        ++Uses.Reads[VD];
+  }
+
+  for (Stmt::const_child_iterator I = S->child_begin(), E = S->child_end();
+       I != E; ++I)
+    scanLocalVarUses(*I, Uses);
+}
+
+/// getPrimaryChainOverrider - Returns the final overrider of MD in a complete
+/// object of class RD, provided a pointer to MD's class within it points to
+/// the overrider's object: MD's class must be a base subobject of RD only
+/// once, with a single final overrider, and must be reached from the
+/// overrider's class through non-virtual primary bases, each at offset 0 in
+/// the next. Otherwise, or if the overrider is pure or covariant, returns
+/// null.
+static const CXXMethodDecl *
+getPrimaryChainOverrider(ASTContext &Context, const CXXRecordDecl *RD,
+                         const CXXMethodDecl *MD) {
+  CXXFinalOverriderMap FinalOverriders;
+  RD->getFinalOverriders(FinalOverriders);
+  CXXFinalOverriderMap::const_iterator Found =
+    FinalOverriders.find(MD->getCanonicalDecl());
+  if (Found == FinalOverriders.end() || Found->second.size() != 1 ||
+      Found->second.begin()->second.size() != 1)
+    return 0;
+  const CXXMethodDecl *Overrider = Found->second.begin()->second[0].Method;
+  if (Overrider->isPure() ||
+      !Context.hasSameType(Overrider->getResultType(), MD->getResultType()))
+    return 0;
+
+  const CXXRecordDecl *Class = MD->getParent();
+  const CXXRecordDecl *Derived = Overrider->getParent();
+  while (Derived != Class) {
+    const ASTRecordLayout &Layout = Context.getASTRecordLayout(Derived);
+    if (!Layout.getPrimaryBase() || Layout.isPrimaryBaseVirtual())
+      return 0;
+    Derived = Layout.getPrimaryBase();
+  }
+  return Overrider;
+}
+
+/// getKnownClassOverrider - If the class of Base (the object of a call to the
+/// virtual method MD) is known, returns the final overrider of MD in it (see
+/// getPrimaryChainOverrider); otherwise returns null. The class is known:
+///
+/// - for this in a constructor or destructor, including its initializers:
+///   the object is of the class being constructed or destroyed meanwhile;
+/// - for a pointer variable initialized by a new-expression, and never
+///   modified nor having its address taken in the current function.
+const CXXMethodDecl *
+CodeGenFunction::getKnownClassOverrider(const Expr *Base,
+                                        const CXXMethodDecl *MD) {
+  if (isa<CXXDestructorDecl>(MD))
+    return 0;
+
+  // A block may run once the object is complete, so only the function's own
+  // code counts.
+  if (isa<CXXThisExpr>(Base->IgnoreParenImpCasts())) {
+    if (CurCodeDecl && (isa<CXXConstructorDecl>(CurCodeDecl) ||
+                        isa<CXXDestructorDecl>(CurCodeDecl)))
+      return getPrimaryChainOverrider(getContext(),
+        cast<CXXMethodDecl>(CurCodeDecl)->getParent(), MD);
+    return 0;
+  }
+
+  const FunctionDecl *FD = dyn_cast_or_null<FunctionDecl>(CurFuncDecl);
+  if (!FD || !FD->getBody())
+    return 0;
+
+  if (NewObjectLocals.empty()) {
+    LocalVarUses Uses;
+    scanLocalVarUses(FD->getBody(), Uses);
+    NewObjectLocals[0] = 0;
+    for (llvm::DenseMap<const VarDecl *, const CXXRecordDecl *>::iterator
+         I = Uses.NewObjects.begin(), E = Uses.NewObjects.end(); I != E; ++I) {
+      if (Uses.References.lookup(I->first) == Uses.Reads.lookup(I->first))
+        NewObjectLocals[I->first] = I->second;
+    }
+  }
+
+  const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Base->IgnoreParenImpCasts());
+  const VarDecl *VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : 0;
+  const CXXRecordDecl *RD = VD ? NewObjectLocals.lookup(VD) : 0;
+  if (!RD)
+    return 0;
+  return getPrimaryChainOverrider(getContext(), RD, MD);
+}
+
+/// getTypeInfoName - Returns the mangled name of the type_info object of a
+/// class, which identifies the class in metadata.
+static llvm::MDString *getTypeInfoName(CodeGenModule &CGM,
+                                       const CXXRecordDecl *RD) {
+  llvm::SmallString<256> Name;
+  CGM.getCXXABI().getMangleContext().mangleCXXRTTI(
+    CGM.getContext().getTagDeclType(RD), Name);
+  return llvm::MDString::get(CGM.getLLVMContext(), Name.str());
+}
+
+/// recordSealedHierarchies - Lists the classes annotated sealed among RD and
+/// its bases, by type_info name, in the devirt.sealed named metadata of the
+/// module. Sealing a class declares that the current link unit defines every
+/// class deriving from it, so the devirtualization pass may treat its
+/// hierarchy as closed even though it is exported.
+static void recordSealedHierarchies(CodeGenModule &CGM,
+                                    const CXXRecordDecl *RD) {
+  RD = RD ? RD->getDefinition() : 0;
+  if (!RD)
+    return;
+  if (hasAnnotation(RD, "sealed")) {
+    llvm::NamedMDNode *Sealed =
+      CGM.getModule().getOrInsertNamedMetadata("devirt.sealed");
+    llvm::Value *Name = getTypeInfoName(CGM, RD);
+    bool Listed = false;
+    for (unsigned I = 0, E = Sealed->getNumOperands(); I != E; ++I)
+      Listed |= Sealed->getOperand(I)->getOperand(0) == Name;
+    if (!Listed)
+      Sealed->addOperand(llvm::MDNode::get(CGM.getLLVMContext(),
+                                           llvm::ArrayRef<llvm::Value*>(Name)));
+  }
+  for (CXXRecordDecl::base_class_const_iterator I = RD->bases_begin(),
+       E = RD->bases_end(); I != E; ++I)
+    recordSealedHierarchies(CGM, I->getType()->getAsCXXRecordDecl());
+}
+
+/// markVirtualCallLoads - Tags the loads of a virtual call's callee, as built
+/// by BuildVirtualCall. The load of the vtable slot reads a vtable, which is
+/// constant: it gets the TBAA tag of an immutable type, so that GVN and LICM
+/// may reuse and hoist it across calls and stores. The load of the vtable
+/// pointer gets vtable-pointer metadata, which lets the devirtualization pass
+/// reuse a dominating one of the same object, and a mutable TBAA tag of its
+/// own, which the class hierarchy alias analysis tells apart from the fields.
+static void markVirtualCallLoads(llvm::Value *Callee, CodeGenModule &CGM) {
+  llvm::LoadInst *Slot = dyn_cast<llvm::LoadInst>(Callee->stripPointerCasts());
+  if (!Slot)
+    return;
+  llvm::LLVMContext &Context = CGM.getLLVMContext();
+  llvm::Value *Root = llvm::MDNode::get(Context,
+    llvm::ArrayRef<llvm::Value*>(llvm::MDString::get(Context, "vtables")));
+  llvm::Value *SlotType[3] = {
+    llvm::MDString::get(Context, "vtable slot"),
+    Root,
+    llvm::ConstantInt::get(llvm::Type::getInt64Ty(Context), 1),
+  };
+  Slot->setMetadata("tbaa",
+    llvm::MDNode::get(Context, llvm::ArrayRef<llvm::Value*>(SlotType)));
+
+  llvm::GetElementPtrInst *SlotPtr =
+    dyn_cast<llvm::GetElementPtrInst>(Slot->getPointerOperand());
+  llvm::LoadInst *VTable = SlotPtr
+    ? dyn_cast<llvm::LoadInst>(SlotPtr->getPointerOperand()) : 0;
+  if (!VTable)
+    return;
+  VTable->setMetadata("vtable-pointer",
+    llvm::MDNode::get(Context, llvm::ArrayRef<llvm::Value*>()));
+  llvm::Value *PointerType[2] = {
+    llvm::MDString::get(Context, "vtable pointer"),
+    Root,
+  };
+  VTable->setMetadata("tbaa",
+    llvm::MDNode::get(Context, llvm::ArrayRef<llvm::Value*>(PointerType)));
+}
+
+/// EmitVirtualCallMetadata - Attaches virtual-call metadata to a virtual call:
+/// the mangled name of the method, whether the call is on this, the type_info
+/// name of the most-derived static class of the receiver, the vtable slot of
+/// the method, a VirtualCallReceiverKind and, if the programmer asserts the
+/// dynamic class of the receiver (see getAssumedDynamicClass), the type_info
+/// name of that class. GD is the method, or the destructor variant, the call
+/// dispatches to.
 static void EmitVirtualCallMetadata(llvm::Instruction* CI,
-                                    const CXXMethodDecl* MD,
+                                    GlobalDecl GD,
                                     const llvm::Type* Ty,
                                     const Expr* Obj,
                                     CodeGenModule& CGM) {
   if (CI) {
-    CGM.GetAddrOfFunction(MD, Ty); // Will force declaration of external class
+    const CXXMethodDecl *MD = cast<CXXMethodDecl>(GD.getDecl());
+    CGM.GetAddrOfFunction(GD, Ty); // Will force declaration of external class
                                    // functions, so there will be a Function*
     while (true) {
       Obj = Obj->IgnoreParens();
@@ -160,19 +658,49 @@ static void EmitVirtualCallMetadata(llvm::Instruction* CI,
       }
       break;
     }
-    llvm::Value* Args[2] = {
-      llvm::MDString::get(CGM.getLLVMContext(), CGM.getMangledName(MD)),
-      llvm::ConstantInt::get(
-        llvm::Type::getInt1Ty(CGM.getLLVMContext()),
-        isa<CXXThisExpr>(Obj)
-      ),
+    const llvm::Type *Int1Ty = llvm::Type::getInt1Ty(CGM.getLLVMContext());
+    const llvm::Type *Int32Ty = llvm::Type::getInt32Ty(CGM.getLLVMContext());
+    const CXXRecordDecl *Assumed = getAssumedDynamicClass(Obj);
+    recordSealedHierarchies(CGM, getMostDerivedClassDecl(Obj));
+
+    llvm::Value* Args[6] = {
+      llvm::MDString::get(CGM.getLLVMContext(), CGM.getMangledName(GD)),
+      llvm::ConstantInt::get(Int1Ty, isa<CXXThisExpr>(Obj)),
+      getTypeInfoName(CGM, getMostDerivedClassDecl(Obj)),
+      llvm::ConstantInt::get(Int32Ty,
+                             CGM.getVTables().getMethodVTableIndex(GD)),
+      llvm::ConstantInt::get(Int32Ty, getVirtualCallReceiverKind(Obj)),
+      Assumed ? getTypeInfoName(CGM, Assumed) : 0,
     };
     CI->setMetadata("virtual-call", 
                     llvm::MDNode::get(CGM.getLLVMContext(), 
-                                      llvm::ArrayRef<llvm::Value*>(Args)));
+                                      llvm::ArrayRef<llvm::Value*>(Args,
+                                                                   Assumed ? 6
+                                                                           : 5)));
+    markVirtualCallLoads(llvm::CallSite(CI).getCalledValue(), CGM);
   }
 }
 
+/// EmitMemberPointerCallMetadata - Attaches member-pointer-call metadata to a
+/// call through a pointer to member function of a dynamic class: the
+/// type_info name of the class and a VirtualCallReceiverKind.
+static void EmitMemberPointerCallMetadata(llvm::Instruction *CI,
+                                          const CXXRecordDecl *RD,
+                                          const Expr *Obj,
+                                          CodeGenModule &CGM) {
+  if (!CI)
+    return;
+  recordSealedHierarchies(CGM, RD);
+  llvm::Value *Args[2] = {
+    getTypeInfoName(CGM, RD),
+    llvm::ConstantInt::get(llvm::Type::getInt32Ty(CGM.getLLVMContext()),
+                           getVirtualCallReceiverKind(Obj)),
+  };
+  CI->setMetadata("member-pointer-call",
+                  llvm::MDNode::get(CGM.getLLVMContext(),
+                                    llvm::ArrayRef<llvm::Value*>(Args)));
+}
+
 // Note: This function also emit constructor calls to support a MSVC
 // extensions allowing explicit constructor function call.
 RValue CodeGenFunction::EmitCXXMemberCallExpr(const CXXMemberCallExpr *CE,
@@ -255,7 +783,14 @@ RValue CodeGenFunction::EmitCXXMemberCallExpr(const CXXMemberCallExpr *CE,
   bool UseVirtualCall;
   UseVirtualCall = MD->isVirtual() && !ME->hasQualifier()
                    && !canDevirtualizeMemberFunctionCalls(getContext(),
-                                                          ME->getBase(), MD);
+                                                          ME->getBase(), MD,
+                                                          CurFuncDecl);
+  // An object of known class: this while it is constructed or destroyed, or
+  // one created in this function.
+  const CXXMethodDecl *Overrider = 0;
+  if (UseVirtualCall && (Overrider = getKnownClassOverrider(ME->getBase(), MD)))
+    UseVirtualCall = false;
+
   llvm::Value *Callee;
   if (const CXXDestructorDecl *Dtor = dyn_cast<CXXDestructorDecl>(MD)) {
     if (UseVirtualCall) {
@@ -273,6 +808,8 @@ RValue CodeGenFunction::EmitCXXMemberCallExpr(const CXXMemberCallExpr *CE,
     Callee = CGM.GetAddrOfFunction(GlobalDecl(Ctor, Ctor_Complete), Ty);
   } else if (UseVirtualCall) {
       Callee = BuildVirtualCall(MD, This, Ty); 
+  } else if (Overrider) {
+    Callee = CGM.GetAddrOfFunction(Overrider, Ty);
   } else {
     if (getContext().getLangOptions().AppleKext &&
         MD->isVirtual() &&
@@ -286,7 +823,10 @@ RValue CodeGenFunction::EmitCXXMemberCallExpr(const CXXMemberCallExpr *CE,
   const RValue RV = EmitCXXMemberCall(MD, Callee, ReturnValue, This, /*VTT=*/0,
                                       CE->arg_begin(), CE->arg_end(), &CI);
   if (UseVirtualCall) {
-    EmitVirtualCallMetadata(CI, MD, Ty, CE->getImplicitObjectArgument(), CGM);
+    GlobalDecl GD(MD);
+    if (const CXXDestructorDecl *Dtor = dyn_cast<CXXDestructorDecl>(MD))
+      GD = GlobalDecl(Dtor, Dtor_Complete);
+    EmitVirtualCallMetadata(CI, GD, Ty, CE->getImplicitObjectArgument(), CGM);
   }
   return RV;
 }
@@ -333,8 +873,12 @@ CodeGenFunction::EmitCXXMemberPointerCallExpr(const CXXMemberCallExpr *E,
   // And the rest of the call args
   EmitCallArgs(Args, FPT, E->arg_begin(), E->arg_end());
   const FunctionType *BO_FPT = BO->getType()->getAs<FunctionProtoType>();
-  return EmitCall(CGM.getTypes().getFunctionInfo(Args, BO_FPT), Callee, 
-                  ReturnValue, Args);
+  llvm::Instruction *CI;
+  RValue RV = EmitCall(CGM.getTypes().getFunctionInfo(Args, BO_FPT), Callee, 
+                       ReturnValue, Args, 0, &CI);
+  if (RD->isDynamicClass())
+    EmitMemberPointerCallMetadata(CI, RD, BaseExpr, CGM);
+  return RV;
 }
 
 RValue
@@ -362,10 +906,11 @@ CodeGenFunction::EmitCXXOperatorMemberCallExpr(const CXXOperatorCallExpr *E,
   const llvm::Type *Ty =
     CGM.getTypes().GetFunctionType(CGM.getTypes().getFunctionInfo(MD),
                                    FPT->isVariadic());
+  bool UseVirtualCall = MD->isVirtual() &&
+    !canDevirtualizeMemberFunctionCalls(getContext(),
+                                        E->getArg(0), MD, CurFuncDecl);
   llvm::Value *Callee;
-  if (MD->isVirtual() && 
-      !canDevirtualizeMemberFunctionCalls(getContext(),
-                                           E->getArg(0), MD))
+  if (UseVirtualCall)
     Callee = BuildVirtualCall(MD, This, Ty);
   else
     Callee = CGM.GetAddrOfFunction(MD, Ty);
@@ -373,7 +918,8 @@ CodeGenFunction::EmitCXXOperatorMemberCallExpr(const CXXOperatorCallExpr *E,
   llvm::Instruction* CI;
   RValue RV = EmitCXXMemberCall(MD, Callee, ReturnValue, This, /*VTT=*/0,
                                 E->arg_begin() + 1, E->arg_end(), &CI);
-  EmitVirtualCallMetadata(CI, MD, Ty, E->getArg(0), CGM);
+  if (UseVirtualCall)
+    EmitVirtualCallMetadata(CI, MD, Ty, E->getArg(0), CGM);
   return RV;
 }
 
@@ -1164,11 +1710,13 @@ namespace {
   };
 }
 
-/// Emit the code for deleting a single object.
+/// Emit the code for deleting a single object. Obj is the deleted pointer
+/// expression, if it points to the object itself.
 static void EmitObjectDelete(CodeGenFunction &CGF,
                              const FunctionDecl *OperatorDelete,
                              llvm::Value *Ptr,
-                             QualType ElementType) {
+                             QualType ElementType,
+                             const Expr *Obj) {
   // Find the destructor for the type, if applicable.  If the
   // destructor is virtual, we'll just emit the vcall and return.
   const CXXDestructorDecl *Dtor = 0;
@@ -1185,8 +1733,12 @@ static void EmitObjectDelete(CodeGenFunction &CGF,
           
         llvm::Value *Callee
           = CGF.BuildVirtualCall(Dtor, Dtor_Deleting, Ptr, Ty);
+        llvm::Instruction *CI;
         CGF.EmitCXXMemberCall(Dtor, Callee, ReturnValueSlot(), Ptr, /*VTT=*/0,
-                              0, 0);
+                              0, 0, &CI);
+        if (Obj)
+          EmitVirtualCallMetadata(CI, GlobalDecl(Dtor, Dtor_Deleting), Ty, Obj,
+                                  CGF.CGM);
 
         // The dtor took care of deleting the object.
         return;
@@ -1355,7 +1907,9 @@ void CodeGenFunction::EmitCXXDeleteExpr(const CXXDeleteExpr *E) {
   if (E->isArrayForm()) {
     EmitArrayDelete(*this, E, Ptr, DeleteTy);
   } else {
-    EmitObjectDelete(*this, E->getOperatorDelete(), Ptr, DeleteTy);
+    const Expr *Obj =
+      Arg->getType()->getPointeeType()->isRecordType() ? Arg : 0;
+    EmitObjectDelete(*this, E->getOperatorDelete(), Ptr, DeleteTy, Obj);
   }
 
   EmitBlock(DeleteEnd);
@@ -1488,6 +2042,8 @@ llvm::Value *CodeGenFunction::EmitDynamicCast(llvm::Value *V,
       = CGM.GetAddrOfRTTIDescriptor(SrcTy.getUnqualifiedType());
     llvm::Value *DestArg
       = CGM.GetAddrOfRTTIDescriptor(DestTy.getUnqualifiedType());
+    recordSealedHierarchies(CGM, SrcTy->getAsCXXRecordDecl());
+    recordSealedHierarchies(CGM, DestTy->getAsCXXRecordDecl());
     
     V = Builder.CreateBitCast(V, Int8PtrTy);
     V = Builder.CreateCall4(CGM.CreateRuntimeFunction(FTy, "__dynamic_cast"),
@@ -1022,6 +1022,12 @@ private:
   llvm::DenseMap<const ValueDecl *, std::pair<const llvm::Type *,
                                               unsigned> > ByRefValueInfo;
 
+  /// NewObjectLocals - The pointer variables of the current function that are
+  /// initialized by a new-expression and never modified nor have their
+  /// address taken, with the class of the object they point to. Computed on
+  /// first use; the null key marks it as computed.
+  llvm::DenseMap<const VarDecl *, const CXXRecordDecl *> NewObjectLocals;
+
   llvm::BasicBlock *TerminateLandingPad;
   llvm::BasicBlock *TerminateHandler;
   llvm::BasicBlock *TrapBB;
@@ -1894,6 +1900,8 @@ public:
                            llvm::Instruction** callOrInvoke = NULL);
   RValue EmitCXXMemberCallExpr(const CXXMemberCallExpr *E,
                                ReturnValueSlot ReturnValue);
+  const CXXMethodDecl *getKnownClassOverrider(const Expr *Base,
+                                              const CXXMethodDecl *MD);
   RValue EmitCXXMemberPointerCallExpr(const CXXMemberCallExpr *E,
                                       ReturnValueSlot ReturnValue);
 